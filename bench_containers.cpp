@@ -0,0 +1,189 @@
+/*
+Container node churn benchmark, SAllocator against std::allocator and SPool
+against new/delete. Link it with malloc_4.cpp (or any backend with the smalloc
+API) and run:
+
+    bench_containers [ops]
+
+Every workload runs in a forked child, once per allocator, and reports
+million operations per second and the peak RSS of that child.
+
+map            - std::map<int, int> of up to 10000 keys, random insert/erase
+list           - std::list<int> of up to 10000 nodes, push at either end,
+                 pop at the other
+unordered_map  - std::unordered_map<int, int> like map, rehashing as it grows
+pool           - 10000 slots of 48 byte objects, random create/destroy
+ */
+
+#include <unistd.h>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include "malloc_4_allocator.h"
+
+#define KEYS 10000
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t sink = 0;
+
+/*******************************************************************************
+ *  WORKLOADS
+ ******************************************************************************/
+
+template <typename Allocator>
+static void map_churn(size_t ops) {
+	std::map<int, int, std::less<int>, typename Allocator::template rebind<std::pair<const int, int>>::other> map;
+	unsigned seed = 1;
+	for (size_t i = 0; i < ops; ++i) {
+		int key = rand_r(&seed) % KEYS;
+		if (not map.erase(key))
+			map.emplace(key, key);
+	}
+	sink += map.size();
+}
+
+template <typename Allocator>
+static void list_churn(size_t ops) {
+	std::list<int, typename Allocator::template rebind<int>::other> list;
+	unsigned seed = 1;
+	for (size_t i = 0; i < ops; ++i) {
+		if (list.size() < KEYS / 2 or rand_r(&seed) % 2) {
+			if (i % 2)
+				list.push_back(i);
+			else
+				list.push_front(i);
+		} else if (i % 2) {
+			list.pop_front();
+		} else {
+			list.pop_back();
+		}
+		if (list.size() > KEYS)
+			list.pop_front();
+	}
+	sink += list.size();
+}
+
+template <typename Allocator>
+static void unordered_map_churn(size_t ops) {
+	std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+			typename Allocator::template rebind<std::pair<const int, int>>::other> map;
+	unsigned seed = 1;
+	for (size_t i = 0; i < ops; ++i) {
+		int key = rand_r(&seed) % KEYS;
+		if (not map.erase(key))
+			map.emplace(key, key);
+	}
+	sink += map.size();
+}
+
+struct PoolObject {
+	size_t fields[6];
+	explicit PoolObject(size_t value) {
+		for (size_t &field : fields)
+			field = value;
+	}
+};
+
+static void pool_churn_spool(size_t ops) {
+	SPool<PoolObject> pool;
+	PoolObject *slots[KEYS] = {nullptr};
+	unsigned seed = 1;
+	for (size_t i = 0; i < ops; ++i) {
+		int slot = rand_r(&seed) % KEYS;
+		if (slots[slot] != nullptr) {
+			pool.destroy(slots[slot]);
+			slots[slot] = nullptr;
+		} else {
+			slots[slot] = pool.create(i);
+		}
+	}
+	for (PoolObject *object : slots)
+		pool.destroy(object);
+}
+
+static void pool_churn_new(size_t ops) {
+	PoolObject *slots[KEYS] = {nullptr};
+	unsigned seed = 1;
+	for (size_t i = 0; i < ops; ++i) {
+		int slot = rand_r(&seed) % KEYS;
+		if (slots[slot] != nullptr) {
+			delete slots[slot];
+			slots[slot] = nullptr;
+		} else {
+			slots[slot] = new PoolObject(i);
+		}
+	}
+	for (PoolObject *object : slots)
+		delete object;
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Workload {
+	const char *name;
+	const char *allocator;
+	void (*run)(size_t ops);
+};
+
+static void run_workload(const Workload &workload, size_t ops) {
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0)
+		return;
+	if (!fork()) {  // measure as son, to get a clear heap
+		close(pipe_fds[0]);
+		double start = now();
+		workload.run(ops);
+		double seconds = now() - start;
+		if (write(pipe_fds[1], &seconds, sizeof(seconds)) != sizeof(seconds))
+			exit(1);
+		exit(0);
+	}
+	close(pipe_fds[1]);
+	double seconds = 0;
+	bool done = read(pipe_fds[0], &seconds, sizeof(seconds)) == sizeof(seconds);
+	close(pipe_fds[0]);
+	int exit_status = 0;
+	rusage usage;
+	wait4(-1, &exit_status, 0, &usage);
+	std::cout << std::left << std::setw(15) << workload.name << std::setw(16) << workload.allocator << std::right;
+	if (!done || exit_status) {
+		std::cout << std::setw(10) << "failed" << std::endl;
+		return;
+	}
+	std::cout << std::fixed << std::setprecision(2) << std::setw(10) << ops / seconds / 1e6
+			  << std::setw(12) << usage.ru_maxrss / 1024.0 << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ops = argc > 1 ? atol(argv[1]) : 2000000;
+	const Workload workloads[] = {
+		{"map", "std::allocator", map_churn<std::allocator<int>>},
+		{"map", "SAllocator", map_churn<SAllocator<int>>},
+		{"list", "std::allocator", list_churn<std::allocator<int>>},
+		{"list", "SAllocator", list_churn<SAllocator<int>>},
+		{"unordered_map", "std::allocator", unordered_map_churn<std::allocator<int>>},
+		{"unordered_map", "SAllocator", unordered_map_churn<SAllocator<int>>},
+		{"pool", "new/delete", pool_churn_new},
+		{"pool", "SPool", pool_churn_spool},
+	};
+	std::cout << std::left << std::setw(15) << "workload" << std::setw(16) << "allocator" << std::right
+			  << std::setw(10) << "Mops/s" << std::setw(12) << "peak RSS MB" << std::endl;
+	for (const Workload &workload : workloads)
+		run_workload(workload, ops);
+	return 0;
+}
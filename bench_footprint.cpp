@@ -0,0 +1,250 @@
+/*
+Memory footprint benchmark. Link it with one backend (malloc_2.cpp,
+malloc_4.cpp or malloc_libc.cpp) and run:
+
+    bench_footprint [ops] [series]
+
+Every workload runs in a forked child. Every ops/100 operations the child
+samples the resident set from /proc/self/statm together with the bytes the
+workload holds and the allocator's _num_allocated_bytes and _num_free_bytes.
+With "series" the samples are printed as well as the summary:
+
+peak        - highest RSS growth over the child's starting RSS
+steady      - mean RSS growth over the second half of the run
+live/RSS    - bytes held by the workload over the RSS growth, at the end
+              and averaged over the second half (1.0 is a perfect fit)
+free        - _num_free_bytes at the end, the bytes the allocator keeps
+              that nobody uses
+
+cache       - entries of 64B to 16KB inserted into a fixed budget, random
+              entries evicted when it is exceeded
+buffers     - buffers grown by srealloc to up to 64KB and shrunk back
+phases      - many small objects, 90% of them freed at random, then large
+              objects that have to fit in the holes
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <sys/wait.h>
+#include <iostream>
+#include <iomanip>
+#include "malloc_3.h"
+
+#define SAMPLES 100
+#define CACHE_ENTRIES 4096
+#define CACHE_BUDGET (8 * 1024 * 1024)
+#define BUFFERS 256
+#define PHASE_OBJECTS 20000
+
+static size_t ops_per_sample = 1;
+static bool print_series = false;
+
+static size_t resident_bytes() {
+	char text[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	ssize_t length = read(fd, text, sizeof(text) - 1);
+	close(fd);
+	if (length <= 0) {
+		return 0;
+	}
+	text[length] = 0;
+	unsigned long size = 0, resident = 0;
+	sscanf(text, "%lu %lu", &size, &resident);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*******************************************************************************
+ *  SAMPLING
+ ******************************************************************************/
+
+struct Footprint {
+	size_t base_rss;
+	size_t live;
+	size_t ops;
+	size_t samples;
+	size_t peak_rss;
+	double steady_rss;
+	double steady_ratio;
+	size_t steady_samples;
+	size_t last_rss;
+};
+
+static void sample(Footprint &footprint, size_t total_ops) {
+	if (++footprint.ops % ops_per_sample != 0) {
+		return;
+	}
+	size_t rss = resident_bytes();
+	rss = rss > footprint.base_rss ? rss - footprint.base_rss : 0;
+	footprint.samples++;
+	footprint.last_rss = rss;
+	if (rss > footprint.peak_rss) {
+		footprint.peak_rss = rss;
+	}
+	if (footprint.ops * 2 >= total_ops and rss != 0) {
+		footprint.steady_rss += rss;
+		footprint.steady_ratio += double(footprint.live) / rss;
+		footprint.steady_samples++;
+	}
+	if (print_series) {
+		std::cout << "  " << std::setw(10) << footprint.ops << std::setw(12) << rss / 1024
+				  << std::setw(12) << footprint.live / 1024 << std::setw(12) << _num_allocated_bytes() / 1024
+				  << std::setw(12) << _num_free_bytes() / 1024 << std::endl;
+	}
+}
+
+/*******************************************************************************
+ *  WORKLOADS
+ ******************************************************************************/
+
+static void cache(Footprint &footprint, size_t ops) {
+	void *entries[CACHE_ENTRIES] = {NULL};
+	size_t sizes[CACHE_ENTRIES] = {0};
+	unsigned seed = 1;
+	for (size_t op = 0; op < ops; ++op) {
+		int slot = rand_r(&seed) % CACHE_ENTRIES;
+		if (entries[slot] == NULL) {
+			sizes[slot] = 64 + rand_r(&seed) % (16 * 1024);
+			entries[slot] = smalloc(sizes[slot]);
+			memset(entries[slot], 1, sizes[slot]);
+			footprint.live += sizes[slot];
+		}
+		while (footprint.live > CACHE_BUDGET) {
+			int victim = rand_r(&seed) % CACHE_ENTRIES;
+			if (entries[victim] != NULL) {
+				sfree(entries[victim]);
+				entries[victim] = NULL;
+				footprint.live -= sizes[victim];
+			}
+		}
+		sample(footprint, ops);
+	}
+}
+
+static void buffers(Footprint &footprint, size_t ops) {
+	char *buffers[BUFFERS] = {NULL};
+	size_t sizes[BUFFERS] = {0};
+	unsigned seed = 2;
+	for (size_t op = 0; op < ops; ++op) {
+		int slot = rand_r(&seed) % BUFFERS;
+		size_t size = sizes[slot];
+		if (size == 0) {
+			size = 16;
+		} else if (rand_r(&seed) % 3 != 0 and size < 64 * 1024) {
+			size *= 2;
+		} else {
+			size = size / 4 + 1;
+		}
+		char *grown = static_cast<char*>(srealloc(buffers[slot], size));
+		if (grown == NULL) {
+			continue;
+		}
+		memset(grown, 2, size);
+		buffers[slot] = grown;
+		footprint.live += size - sizes[slot];
+		sizes[slot] = size;
+		sample(footprint, ops);
+	}
+}
+
+static void phases(Footprint &footprint, size_t ops) {
+	static void *objects[PHASE_OBJECTS];
+	static size_t sizes[PHASE_OBJECTS];
+	unsigned seed = 3;
+	size_t op = 0;
+	while (op < ops) {
+		for (int i = 0; i < PHASE_OBJECTS and op < ops; ++i, ++op) { // small objects
+			sizes[i] = 16 + rand_r(&seed) % 256;
+			objects[i] = smalloc(sizes[i]);
+			memset(objects[i], 3, sizes[i]);
+			footprint.live += sizes[i];
+			sample(footprint, ops);
+		}
+		for (int i = 0; i < PHASE_OBJECTS; ++i) { // most of them die
+			if (objects[i] != NULL and rand_r(&seed) % 10 != 0) {
+				sfree(objects[i]);
+				objects[i] = NULL;
+				footprint.live -= sizes[i];
+			}
+		}
+		void *large[PHASE_OBJECTS / 64];
+		int large_count = 0;
+		for (; large_count < PHASE_OBJECTS / 64 and op < ops; ++large_count, ++op) { // bigger ones
+			large[large_count] = smalloc(4096);
+			memset(large[large_count], 4, 4096);
+			footprint.live += 4096;
+			sample(footprint, ops);
+		}
+		for (int i = 0; i < PHASE_OBJECTS; ++i) {
+			if (objects[i] != NULL) {
+				sfree(objects[i]);
+				objects[i] = NULL;
+				footprint.live -= sizes[i];
+			}
+		}
+		for (int i = 0; i < large_count; ++i) {
+			sfree(large[i]);
+			footprint.live -= 4096;
+		}
+	}
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Workload {
+	const char *name;
+	void (*run)(Footprint&, size_t);
+};
+
+static void run_workload(const Workload &workload, size_t ops) {
+	if (!fork()) {  // measure as son, to get a fresh heap and RSS
+		Footprint footprint;
+		memset(&footprint, 0, sizeof(footprint));
+		footprint.base_rss = resident_bytes();
+		if (print_series) {
+			std::cout << workload.name << std::endl << "  " << std::setw(10) << "ops" << std::setw(12) << "RSS KB"
+					  << std::setw(12) << "live KB" << std::setw(12) << "alloc KB" << std::setw(12) << "free KB" << std::endl;
+		}
+		workload.run(footprint, ops);
+		size_t steady = footprint.steady_samples ? footprint.steady_rss / footprint.steady_samples : 0;
+		double steady_ratio = footprint.steady_samples ? footprint.steady_ratio / footprint.steady_samples : 0;
+		double final_ratio = footprint.last_rss ? double(footprint.live) / footprint.last_rss : 0;
+		std::cout << std::left << std::setw(10) << workload.name << std::right
+				  << std::setw(12) << footprint.peak_rss / 1024
+				  << std::setw(12) << steady / 1024
+				  << std::setw(12) << std::fixed << std::setprecision(3) << final_ratio
+				  << std::setw(12) << steady_ratio
+				  << std::setw(12) << _num_free_bytes() / 1024 << std::endl;
+		exit(0);
+	}
+	int exit_status = 0;
+	wait(&exit_status);
+	if (exit_status) {
+		std::cout << workload.name << " failed" << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ops = argc > 1 ? atol(argv[1]) : 200000;
+	print_series = argc > 2 and strcmp(argv[2], "series") == 0;
+	ops_per_sample = ops / SAMPLES ? ops / SAMPLES : 1;
+	const Workload workloads[] = {
+		{"cache", cache},
+		{"buffers", buffers},
+		{"phases", phases},
+	};
+	if (!print_series) {
+		std::cout << std::left << std::setw(10) << "workload" << std::right << std::setw(12) << "peak KB"
+				  << std::setw(12) << "steady KB" << std::setw(12) << "live/RSS" << std::setw(12) << "steady l/R"
+				  << std::setw(12) << "free KB" << std::endl;
+	}
+	for (const Workload &workload : workloads) {
+		run_workload(workload, ops);
+	}
+	return 0;
+}
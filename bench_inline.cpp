@@ -0,0 +1,184 @@
+/*
+Cost per allocation of the inline fast path (malloc_4_inline.h) against the
+out-of-line entry points. Link it with malloc_4.cpp and run:
+
+    bench_inline [ops]
+
+Every workload keeps 64 blocks of 16-256 bytes live and replaces one of them per
+operation (one free and one allocation), in a forked child, once per entry
+point. It reports user space instructions per operation, read from the
+PERF_COUNT_HW_INSTRUCTIONS counter, and rdtsc cycles and nanoseconds per
+operation. Where perf events are not available (no PMU, or
+kernel.perf_event_paranoid too high) the instruction column reads n/a.
+
+smalloc/sfree               - the C entry points
+smalloc/sfree_sized         - sfree told the size, no page map lookup
+smalloc_inline/sfree_inline - the thread cache, inlined into the loop
+ */
+
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include <time.h>
+#include <x86intrin.h>
+#include <iostream>
+#include <iomanip>
+#include "malloc_4.h"
+#include "malloc_4_inline.h"
+
+#define LIVE 64
+#define SIZES 4096
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// counts the calling thread's user space instructions, -1 when perf events are unavailable
+static int open_instruction_counter() {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*******************************************************************************
+ *  ENTRY POINTS
+ ******************************************************************************/
+
+// classes rather than function pointers, so the inline path really is inlined
+struct CEntry {
+	static void *allocate(size_t size) { return smalloc(size); }
+	static void release(void *p, size_t) { sfree(p); }
+};
+
+struct SizedEntry {
+	static void *allocate(size_t size) { return smalloc(size); }
+	static void release(void *p, size_t size) { sfree_sized(p, size); }
+};
+
+struct InlineEntry {
+	static void *allocate(size_t size) { return smalloc_inline(size); }
+	static void release(void *p, size_t size) { sfree_inline(p, size); }
+};
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Result {
+	double instructions; // negative when not counted
+	double cycles;
+	double nanoseconds;
+};
+
+template <typename Entry>
+static void churn(const size_t *sizes, size_t ops) {
+	void *slots[LIVE];
+	size_t slot_sizes[LIVE];
+	for (int slot = 0; slot < LIVE; ++slot) {
+		slot_sizes[slot] = sizes[slot];
+		slots[slot] = Entry::allocate(slot_sizes[slot]);
+	}
+	for (size_t i = 0; i < ops; ++i) {
+		size_t slot = i % LIVE;
+		Entry::release(slots[slot], slot_sizes[slot]);
+		slot_sizes[slot] = sizes[i % SIZES];
+		slots[slot] = Entry::allocate(slot_sizes[slot]);
+		*static_cast<char *>(slots[slot]) = 1;
+	}
+	for (int slot = 0; slot < LIVE; ++slot) {
+		Entry::release(slots[slot], slot_sizes[slot]);
+	}
+}
+
+template <typename Entry>
+static Result measure(size_t ops) {
+	static size_t sizes[SIZES];
+	unsigned seed = 1;
+	for (size_t i = 0; i < SIZES; ++i) {
+		sizes[i] = 16 + rand_r(&seed) % (SINLINE_MAX_SIZE - 16 + 1);
+	}
+	churn<Entry>(sizes, ops / 10); // warm up: heap grown, caches filled
+	int counter = open_instruction_counter();
+	Result result = {-1, 0, 0};
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	double start = now();
+	unsigned long long start_cycles = __rdtsc();
+	churn<Entry>(sizes, ops);
+	unsigned long long cycles = __rdtsc() - start_cycles;
+	double seconds = now() - start;
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		uint64_t instructions = 0;
+		if (read(counter, &instructions, sizeof(instructions)) == sizeof(instructions))
+			result.instructions = double(instructions) / ops;
+		close(counter);
+	}
+	result.cycles = double(cycles) / ops;
+	result.nanoseconds = seconds * 1e9 / ops;
+	return result;
+}
+
+// runs measure in a forked child for a clear heap, false when the child failed
+template <typename Entry>
+static bool run_workload(size_t ops, Result *result) {
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0)
+		return false;
+	if (!fork()) {
+		close(pipe_fds[0]);
+		Result measured = measure<Entry>(ops);
+		if (write(pipe_fds[1], &measured, sizeof(measured)) != sizeof(measured))
+			exit(1);
+		exit(0);
+	}
+	close(pipe_fds[1]);
+	bool complete = read(pipe_fds[0], result, sizeof(*result)) == sizeof(*result);
+	close(pipe_fds[0]);
+	int exit_status = 0;
+	wait(&exit_status);
+	return complete and exit_status == 0;
+}
+
+template <typename Entry>
+static void report(const char *name, size_t ops) {
+	Result result;
+	bool complete = run_workload<Entry>(ops, &result);
+	std::cout << std::left << std::setw(30) << name << std::right;
+	if (not complete) {
+		std::cout << std::setw(14) << "failed" << std::endl;
+		return;
+	}
+	std::cout << std::fixed << std::setprecision(1);
+	if (result.instructions < 0)
+		std::cout << std::setw(14) << "n/a";
+	else
+		std::cout << std::setw(14) << result.instructions;
+	std::cout << std::setw(12) << result.cycles << std::setw(10) << result.nanoseconds << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ops = argc > 1 ? atol(argv[1]) : 5000000;
+	std::cout << std::left << std::setw(30) << "entry point" << std::right << std::setw(14) << "instructions"
+			  << std::setw(12) << "cycles" << std::setw(10) << "ns" << "   per free + allocation" << std::endl;
+	report<CEntry>("smalloc/sfree", ops);
+	report<SizedEntry>("smalloc/sfree_sized", ops);
+	report<InlineEntry>("smalloc_inline/sfree_inline", ops);
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+Per-operation latency benchmark. Link it with one backend (malloc_2.cpp,
+malloc_4.cpp or malloc_libc.cpp) and run:
+
+    bench_latency [ops]
+
+Every smalloc, sfree and srealloc call is timed on its own with
+CLOCK_MONOTONIC (the timer's own cost is measured first and subtracted) and
+counted in a log-linear histogram with 32 sub-buckets per power of two, so
+every percentile is within about 3% of the real value. For each workload
+and operation it prints p50, p99, p99.9 and max in nanoseconds, then the
+slowest calls. When malloc_4 is built with MALLOC_PATH_STATS each of those
+is flagged with the allocator path it took.
+
+small       - random 8B-1KB blocks, freed and replaced at random
+mixed       - mostly small blocks with some up to 512KB (mmap sized)
+realloc     - srealloc-grown and shrunk buffers up to 64KB
+ */
+
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/wait.h>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include "malloc_3.h"
+#ifdef MALLOC_PATH_STATS
+#include "malloc_4.h"
+#endif
+
+#define SLOTS 4096
+#define SUB_BUCKETS 32
+#define HISTOGRAM_BUCKETS (2 * SUB_BUCKETS + 40 * SUB_BUCKETS)
+#define OUTLIERS 8
+
+typedef unsigned long long counter;
+
+static counter timer_cost = 0;
+
+static inline counter now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ *  HISTOGRAM
+ ******************************************************************************/
+
+struct Histogram {
+	counter buckets[HISTOGRAM_BUCKETS];
+	counter count;
+	counter max;
+};
+
+static int bucket_of(counter value) {
+	if (value < 2 * SUB_BUCKETS) {
+		return value;
+	}
+	int shift = 63 - __builtin_clzll(value) - 5; // keeps the top 6 bits
+	int index = 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+	return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// highest value that falls in the bucket
+static counter bucket_value(int index) {
+	if (index < 2 * SUB_BUCKETS) {
+		return index;
+	}
+	int shift = (index - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+	counter sub = (index - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+static void record(Histogram &histogram, counter value) {
+	histogram.buckets[bucket_of(value)]++;
+	histogram.count++;
+	if (value > histogram.max) {
+		histogram.max = value;
+	}
+}
+
+static counter percentile(const Histogram &histogram, double fraction) {
+	counter rank = histogram.count * fraction;
+	counter seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		seen += histogram.buckets[i];
+		if (seen > rank) {
+			return bucket_value(i) < histogram.max ? bucket_value(i) : histogram.max;
+		}
+	}
+	return histogram.max;
+}
+
+/*******************************************************************************
+ *  TIMED CALLS
+ ******************************************************************************/
+
+struct Outlier {
+	counter ns;
+	const char *op;
+	size_t size;
+	const char *path;
+};
+
+struct Latencies {
+	Histogram malloc, free, realloc;
+	Outlier outliers[OUTLIERS];
+};
+
+static void note(Latencies &latencies, Histogram &histogram, counter start, const char *op, size_t size) {
+	counter elapsed = now_ns() - start;
+	elapsed = elapsed > timer_cost ? elapsed - timer_cost : 0;
+	record(histogram, elapsed);
+	int fastest = 0;
+	for (int i = 1; i < OUTLIERS; ++i) {
+		if (latencies.outliers[i].ns < latencies.outliers[fastest].ns) {
+			fastest = i;
+		}
+	}
+	if (elapsed > latencies.outliers[fastest].ns) {
+		Outlier &outlier = latencies.outliers[fastest];
+		outlier.ns = elapsed;
+		outlier.op = op;
+		outlier.size = size;
+#ifdef MALLOC_PATH_STATS
+		outlier.path = spath_stats_last();
+#else
+		outlier.path = "-";
+#endif
+	}
+}
+
+static void *timed_malloc(Latencies &latencies, size_t size) {
+	counter start = now_ns();
+	void *block = smalloc(size);
+	note(latencies, latencies.malloc, start, "smalloc", size);
+	return block;
+}
+
+static void timed_free(Latencies &latencies, void *block, size_t size) {
+	counter start = now_ns();
+	sfree(block);
+	note(latencies, latencies.free, start, "sfree", size);
+}
+
+static void *timed_realloc(Latencies &latencies, void *block, size_t size) {
+	counter start = now_ns();
+	void *moved = srealloc(block, size);
+	note(latencies, latencies.realloc, start, "srealloc", size);
+	return moved;
+}
+
+/*******************************************************************************
+ *  WORKLOADS
+ ******************************************************************************/
+
+static void *slots[SLOTS];
+static size_t sizes[SLOTS];
+
+static void replace_at_random(Latencies &latencies, size_t ops, unsigned seed, bool with_large) {
+	for (size_t op = 0; op < ops; ++op) {
+		int slot = rand_r(&seed) % SLOTS;
+		if (slots[slot] != NULL) {
+			timed_free(latencies, slots[slot], sizes[slot]);
+		}
+		sizes[slot] = with_large and rand_r(&seed) % 64 == 0 ? 4096 + rand_r(&seed) % (512 * 1024)
+															  : 8 + rand_r(&seed) % 1016;
+		slots[slot] = timed_malloc(latencies, sizes[slot]);
+		static_cast<char*>(slots[slot])[0] = 1;
+	}
+}
+
+static void small(Latencies &latencies, size_t ops) {
+	replace_at_random(latencies, ops, 1, false);
+}
+
+static void mixed(Latencies &latencies, size_t ops) {
+	replace_at_random(latencies, ops, 2, true);
+}
+
+static void realloc_buffers(Latencies &latencies, size_t ops) {
+	unsigned seed = 3;
+	for (size_t op = 0; op < ops; ++op) {
+		int slot = rand_r(&seed) % (SLOTS / 16);
+		size_t size = sizes[slot] == 0 ? 16 : rand_r(&seed) % 3 != 0 and sizes[slot] < 64 * 1024 ? sizes[slot] * 2
+																									: sizes[slot] / 4 + 1;
+		void *moved = slots[slot] == NULL ? timed_malloc(latencies, size) : timed_realloc(latencies, slots[slot], size);
+		if (moved != NULL) {
+			static_cast<char*>(moved)[size - 1] = 1;
+			slots[slot] = moved;
+			sizes[slot] = size;
+		}
+	}
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Workload {
+	const char *name;
+	void (*run)(Latencies&, size_t);
+};
+
+static bool slower(const Outlier &a, const Outlier &b) {
+	return a.ns > b.ns;
+}
+
+static void print_histogram(const char *workload, const char *op, const Histogram &histogram) {
+	if (histogram.count == 0) {
+		return;
+	}
+	std::cout << std::left << std::setw(10) << workload << std::setw(10) << op << std::right
+			  << std::setw(10) << histogram.count
+			  << std::setw(8) << percentile(histogram, 0.5)
+			  << std::setw(8) << percentile(histogram, 0.99)
+			  << std::setw(8) << percentile(histogram, 0.999)
+			  << std::setw(10) << histogram.max << std::endl;
+}
+
+static void run_workload(const Workload &workload, size_t ops) {
+	if (!fork()) {  // measure as son, to get a fresh heap
+		static Latencies latencies;
+		workload.run(latencies, ops);
+		print_histogram(workload.name, "smalloc", latencies.malloc);
+		print_histogram(workload.name, "sfree", latencies.free);
+		print_histogram(workload.name, "srealloc", latencies.realloc);
+		std::sort(latencies.outliers, latencies.outliers + OUTLIERS, slower);
+		for (int i = 0; i < OUTLIERS; ++i) {
+			const Outlier &outlier = latencies.outliers[i];
+			if (outlier.op != NULL) {
+				std::cout << "    slow " << std::left << std::setw(9) << outlier.op << std::right << std::setw(8)
+						  << outlier.size << "B " << std::setw(9) << outlier.ns << "ns  " << outlier.path << std::endl;
+			}
+		}
+		exit(0);
+	}
+	int exit_status = 0;
+	wait(&exit_status);
+	if (exit_status) {
+		std::cout << workload.name << " failed" << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ops = argc > 1 ? atol(argv[1]) : 200000;
+	counter start = now_ns();
+	for (int i = 0; i < 1000; ++i) {
+		now_ns();
+	}
+	timer_cost = (now_ns() - start) / 1000;
+	const Workload workloads[] = {
+		{"small", small},
+		{"mixed", mixed},
+		{"realloc", realloc_buffers},
+	};
+	std::cout << std::left << std::setw(10) << "workload" << std::setw(10) << "op" << std::right
+			  << std::setw(10) << "calls" << std::setw(8) << "p50" << std::setw(8) << "p99"
+			  << std::setw(8) << "p99.9" << std::setw(10) << "max ns" << std::endl;
+	for (const Workload &workload : workloads) {
+		run_workload(workload, ops);
+	}
+	return 0;
+}
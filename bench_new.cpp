@@ -0,0 +1,168 @@
+/*
+Overhead of the operator new/delete replacement (malloc_4_new.cpp) against
+the C entry points it wraps. Link it with malloc_4.cpp and malloc_4_new.cpp
+and run:
+
+    bench_new [ops]
+
+Every workload keeps 10000 slots and fills or empties a random one per
+operation, in a forked child, once per entry point. It reports nanoseconds
+per operation and the difference to smalloc/sfree on the same sizes.
+
+smalloc/sfree       - the C entry points
+smalloc/sfree_sized - sfree told the size, no page map lookup for small blocks
+new/delete          - ::operator new and the unsized ::operator delete
+new/sized delete    - ::operator delete(p, size), what delete on a complete
+                      type compiles to
+aligned new/delete  - ::operator new(size, std::align_val_t(64)), taking
+                      smemalign
+ */
+
+#include <unistd.h>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include "malloc_4.h"
+
+#define SLOTS 10000
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*******************************************************************************
+ *  ENTRY POINTS
+ ******************************************************************************/
+
+struct EntryPoint {
+	const char *name;
+	void *(*allocate)(size_t size);
+	void (*release)(void *p, size_t size);
+};
+
+static void *c_allocate(size_t size) {
+	return smalloc(size);
+}
+
+static void c_release(void *p, size_t) {
+	sfree(p);
+}
+
+static void c_release_sized(void *p, size_t size) {
+	sfree_sized(p, size);
+}
+
+static void *new_allocate(size_t size) {
+	return ::operator new(size);
+}
+
+static void new_release(void *p, size_t) {
+	::operator delete(p);
+}
+
+static void new_release_sized(void *p, size_t size) {
+	::operator delete(p, size);
+}
+
+static void *aligned_allocate(size_t size) {
+	return ::operator new(size, std::align_val_t(64));
+}
+
+static void aligned_release(void *p, size_t) {
+	::operator delete(p, std::align_val_t(64));
+}
+
+static const EntryPoint entry_points[] = {
+	{"smalloc/sfree", c_allocate, c_release},
+	{"smalloc/sfree_sized", c_allocate, c_release_sized},
+	{"new/delete", new_allocate, new_release},
+	{"new/sized delete", new_allocate, new_release_sized},
+	{"aligned new/delete", aligned_allocate, aligned_release},
+};
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static void churn(const EntryPoint &entry, size_t min_size, size_t max_size, size_t ops) {
+	static void *slots[SLOTS];
+	static size_t sizes[SLOTS];
+	unsigned seed = 1;
+	for (size_t i = 0; i < ops; ++i) {
+		int slot = rand_r(&seed) % SLOTS;
+		if (slots[slot] != nullptr) {
+			entry.release(slots[slot], sizes[slot]);
+			slots[slot] = nullptr;
+		} else {
+			sizes[slot] = min_size + rand_r(&seed) % (max_size - min_size + 1);
+			slots[slot] = entry.allocate(sizes[slot]);
+			*static_cast<char *>(slots[slot]) = 1;
+		}
+	}
+	for (int slot = 0; slot < SLOTS; ++slot) {
+		if (slots[slot] != nullptr)
+			entry.release(slots[slot], sizes[slot]);
+	}
+}
+
+// nanoseconds per operation, or a negative value when the child failed
+static double run_workload(const EntryPoint &entry, size_t min_size, size_t max_size, size_t ops) {
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0)
+		return -1;
+	if (!fork()) {  // measure as son, to get a clear heap
+		close(pipe_fds[0]);
+		double start = now();
+		churn(entry, min_size, max_size, ops);
+		double nanoseconds = (now() - start) * 1e9 / ops;
+		if (write(pipe_fds[1], &nanoseconds, sizeof(nanoseconds)) != sizeof(nanoseconds))
+			exit(1);
+		exit(0);
+	}
+	close(pipe_fds[1]);
+	double nanoseconds = -1;
+	if (read(pipe_fds[0], &nanoseconds, sizeof(nanoseconds)) != sizeof(nanoseconds))
+		nanoseconds = -1;
+	close(pipe_fds[0]);
+	int exit_status = 0;
+	wait(&exit_status);
+	return exit_status ? -1 : nanoseconds;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ops = argc > 1 ? atol(argv[1]) : 2000000;
+	const struct {
+		const char *name;
+		size_t min_size;
+		size_t max_size;
+	} workloads[] = {
+		{"16-128B", 16, 128},
+		{"128B-1KB", 128, 1024},
+		{"4KB-64KB", 4096, 65536},
+	};
+	std::cout << std::left << std::setw(12) << "sizes" << std::setw(22) << "entry point" << std::right
+			  << std::setw(10) << "ns/op" << std::setw(12) << "vs C" << std::endl;
+	for (const auto &workload : workloads) {
+		double baseline = 0;
+		for (const EntryPoint &entry : entry_points) {
+			double nanoseconds = run_workload(entry, workload.min_size, workload.max_size, ops);
+			std::cout << std::left << std::setw(12) << workload.name << std::setw(22) << entry.name << std::right;
+			if (nanoseconds < 0) {
+				std::cout << std::setw(10) << "failed" << std::endl;
+				continue;
+			}
+			if (&entry == entry_points)
+				baseline = nanoseconds;
+			std::cout << std::fixed << std::setprecision(1) << std::setw(10) << nanoseconds
+					  << std::showpos << std::setw(11) << (nanoseconds / baseline - 1) * 100 << "%"
+					  << std::noshowpos << std::endl;
+		}
+	}
+	return 0;
+}
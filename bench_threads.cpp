@@ -0,0 +1,263 @@
+/*
+Multi-threaded allocator benchmark. Link it with a thread safe backend
+(malloc_4.cpp or malloc_libc.cpp) and run:
+
+    bench_threads [max_threads] [seconds]
+
+Every workload runs in a forked child at 1, 2, 4, ... max_threads threads and
+reports throughput and the peak RSS of that child.
+
+larson    - every thread replaces random slots of its own array with new
+            blocks of random size, and hands the array to another thread
+            after each round, so most frees are cross-thread
+xmalloc   - half of the threads allocate and pass the blocks through a ring
+            to the other half, which free them
+churn     - every thread allocates and frees its own blocks only
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include "malloc_3.h"
+
+#define MAX_THREADS 64
+#define LARSON_SLOTS 1000
+#define LARSON_ROUND 10000
+#define RING_SIZE 1024
+#define MIN_BLOCK 8
+#define MAX_BLOCK 1000
+
+typedef unsigned long long counter;
+
+static volatile bool stop = false;
+static int thread_count = 1;
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t random_size(unsigned *seed) {
+	return MIN_BLOCK + rand_r(seed) % (MAX_BLOCK - MIN_BLOCK);
+}
+
+static void touch(void *block, size_t size) {
+	static_cast<char*>(block)[0] = 1;
+	static_cast<char*>(block)[size - 1] = 1;
+}
+
+/*******************************************************************************
+ *  WORKLOADS
+ ******************************************************************************/
+
+struct Worker {
+	pthread_t thread;
+	int id;
+	counter ops;
+};
+
+// larson: every thread swaps its array with the spare one after each round
+static void **larson_arrays[MAX_THREADS];
+static void **larson_spare;
+static pthread_mutex_t larson_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *larson(void *arg) {
+	Worker *self = static_cast<Worker*>(arg);
+	unsigned seed = self->id + 1;
+	void **slots = larson_arrays[self->id];
+	while (!stop) {
+		for (int i = 0; i < LARSON_ROUND; ++i) {
+			int slot = rand_r(&seed) % LARSON_SLOTS;
+			sfree(slots[slot]);
+			size_t size = random_size(&seed);
+			slots[slot] = smalloc(size);
+			touch(slots[slot], size);
+		}
+		self->ops += LARSON_ROUND;
+		pthread_mutex_lock(&larson_lock);
+		void **theirs = larson_spare;
+		larson_spare = slots;
+		slots = theirs;
+		pthread_mutex_unlock(&larson_lock);
+	}
+	return NULL;
+}
+
+static void **larson_array(unsigned *seed) {
+	void **slots = static_cast<void**>(calloc(LARSON_SLOTS, sizeof(void*)));
+	for (int i = 0; i < LARSON_SLOTS; ++i) {
+		slots[i] = smalloc(random_size(seed));
+	}
+	return slots;
+}
+
+static void larson_setup() {
+	unsigned seed = 0;
+	for (int t = 0; t < thread_count; ++t) {
+		larson_arrays[t] = larson_array(&seed);
+	}
+	larson_spare = larson_array(&seed);
+}
+
+// xmalloc: single producer single consumer rings, producer i feeds consumer i
+struct Ring {
+	void *volatile blocks[RING_SIZE];
+	volatile counter head, tail;
+};
+
+static Ring rings[MAX_THREADS];
+
+static void *xmalloc_producer(void *arg) {
+	Worker *self = static_cast<Worker*>(arg);
+	unsigned seed = self->id + 1;
+	Ring *ring = &rings[self->id / 2];
+	while (!stop) {
+		if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) { // full, let the consumer run
+			sched_yield();
+			continue;
+		}
+		size_t size = random_size(&seed);
+		void *block = smalloc(size);
+		touch(block, size);
+		ring->blocks[ring->head % RING_SIZE] = block;
+		__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+		self->ops++;
+	}
+	return NULL;
+}
+
+static void *xmalloc_consumer(void *arg) {
+	Worker *self = static_cast<Worker*>(arg);
+	Ring *ring = &rings[self->id / 2];
+	while (!stop) {
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+			sched_yield();
+			continue;
+		}
+		sfree(ring->blocks[ring->tail % RING_SIZE]);
+		__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+		self->ops++;
+	}
+	return NULL;
+}
+
+static void *xmalloc(void *arg) {
+	Worker *self = static_cast<Worker*>(arg);
+	if (thread_count == 1) { // a single thread plays both sides
+		unsigned seed = 1;
+		void *blocks[RING_SIZE];
+		while (!stop) {
+			for (int i = 0; i < RING_SIZE; ++i) {
+				size_t size = random_size(&seed);
+				blocks[i] = smalloc(size);
+				touch(blocks[i], size);
+			}
+			for (int i = 0; i < RING_SIZE; ++i) {
+				sfree(blocks[i]);
+			}
+			self->ops += 2 * RING_SIZE;
+		}
+		return NULL;
+	}
+	return self->id % 2 == 0 ? xmalloc_producer(arg) : xmalloc_consumer(arg);
+}
+
+static void *churn(void *arg) {
+	Worker *self = static_cast<Worker*>(arg);
+	unsigned seed = self->id + 1;
+	void *blocks[64] = {NULL};
+	while (!stop) {
+		for (int i = 0; i < 64; ++i) {
+			size_t size = random_size(&seed);
+			blocks[i] = smalloc(size);
+			touch(blocks[i], size);
+		}
+		for (int i = 63; i >= 0; --i) {
+			sfree(blocks[i]);
+		}
+		self->ops += 128;
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Workload {
+	const char *name;
+	void *(*run)(void*);
+	void (*setup)();
+};
+
+static void run_workload(const Workload &workload, int threads, double seconds) {
+	if (!fork()) {  // measure as son, to get a fresh heap and RSS
+		thread_count = threads;
+		if (workload.setup) {
+			workload.setup();
+		}
+		Worker workers[MAX_THREADS];
+		double start = now();
+		for (int i = 0; i < threads; ++i) {
+			workers[i].id = i;
+			workers[i].ops = 0;
+			assert(pthread_create(&workers[i].thread, NULL, workload.run, &workers[i]) == 0);
+		}
+		usleep(seconds * 1e6);
+		stop = true;
+		counter ops = 0;
+		for (int i = 0; i < threads; ++i) {
+			pthread_join(workers[i].thread, NULL);
+			ops += workers[i].ops;
+		}
+		double elapsed = now() - start;
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		std::cout << std::left << std::setw(10) << workload.name << std::right
+				  << std::setw(8) << threads
+				  << std::setw(14) << std::fixed << std::setprecision(2) << ops / elapsed / 1e6
+				  << std::setw(12) << usage.ru_maxrss / 1024 << std::endl;
+		exit(0);
+	}
+	int exit_status = 0;
+	wait(&exit_status);
+	if (exit_status) {
+		std::cout << workload.name << " with " << threads << " threads failed" << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	double seconds = argc > 2 ? atof(argv[2]) : 1;
+	if (max_threads < 1 || max_threads > MAX_THREADS) {
+		std::cout << "max_threads must be between 1 and " << MAX_THREADS << std::endl;
+		return 1;
+	}
+	const Workload workloads[] = {
+		{"larson", larson, larson_setup},
+		{"xmalloc", xmalloc, NULL},
+		{"churn", churn, NULL},
+	};
+	std::cout << std::left << std::setw(10) << "workload" << std::right << std::setw(8) << "threads"
+			  << std::setw(14) << "Mops/s" << std::setw(12) << "peak RSS MB" << std::endl;
+	for (const Workload &workload : workloads) {
+		for (int threads = 1; ; threads *= 2) {
+			threads = threads > max_threads ? max_threads : threads;
+			run_workload(workload, threads, seconds);
+			if (threads == max_threads) {
+				break;
+			}
+		}
+	}
+	return 0;
+}
@@ -1,25 +1,73 @@
+#include "malloc_4.h"
+#include "malloc_4_telemetry.h"
+#include "malloc_4_inline.h"
 #include <cstring>
 #include <unistd.h>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <sys/mman.h>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <pthread.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <ctime>
+#ifdef MALLOC_PATH_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MALLOC_PROBES
+#endif
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#define MALLOC_RSEQ
+#endif
+#endif
 
 using std::memset;
 using std::memmove;
+using std::memcpy;
+using std::sort;
+using std::less;
+using std::atomic;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::memory_order_acquire;
 
 #define MMAP_MIN_SIZE (128 * 1024)
 #define BIN_MAX_SIZE 128
 #define MIN_SPLIT 128
 #define KB 1024
+#define REGION_CHUNK_SIZE (256 * 1024)
+#define FAST_BIN_MAX_SIZE 128
+#define FAST_BINS (FAST_BIN_MAX_SIZE / 8 + 1)
+#define FAST_BIN_CONSOLIDATION_THRESHOLD (64 * 1024)
+// what operator new owes its callers (__STDCPP_DEFAULT_NEW_ALIGNMENT__ on x86-64)
+#define MALLOC_ALIGNMENT 16
+#define MAX_SIZE 100000000
 
-struct MallocMetadata{
+struct alignas(MALLOC_ALIGNMENT) MallocMetadata{
     size_t size;
     bool is_free;
+    bool is_region;
+    bool in_fast_bin;
+    bool is_sampled;
+    bool is_purged; // a free block whose pages the decay thread already gave back
     void* address;
     MallocMetadata* next;
     MallocMetadata* prev;
     MallocMetadata* next_free;
     MallocMetadata* prev_free;
+    SHandleEntry* handle; // the handle of an allocated block scompact may move, nullptr otherwise
 };
 
 static MallocMetadata* list_block_head = nullptr;
@@ -27,363 +75,2606 @@ static MallocMetadata* list_block_tail = nullptr;
 static MallocMetadata* mmap_list_block_head = nullptr;
 static MallocMetadata* mmap_list_block_tail = nullptr;
 static MallocMetadata* free_bins[BIN_MAX_SIZE] = {nullptr};
+// exact-size LIFO lists of small freed blocks, linked through next_free and not yet merged
+static MallocMetadata* fast_bins[FAST_BINS] = {nullptr};
+static size_t fast_bin_bytes = 0;
+/* One lock guards the heap. sfree calls that find it taken push their block on
+ * remote_frees (linked through the first word of the block) and return without
+ * waiting; the lock holder drains the whole list on its next smalloc or sfree. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<void*> remote_frees(nullptr);
+// set while the decay thread runs, which then owns giving free memory back
+static bool decay_running = false;
+
+/* USDT probes, provider smalloc, for bpftrace and perf. They are built in
+ * whenever sys/sdt.h (systemtap-sdt-dev) is installed: each is a nop and an
+ * ELF note until a tracer attaches, and without the header they compile out.
+ *   smalloc(size, ptr)            smemalign(alignment, size, ptr)
+ *   sfree(ptr)                    sfree_remote(ptr)
+ *   srealloc(oldp, size, ptr)     path(name), see PATH_TAKEN
+ *   split_block(block, size, size_left)
+ *   merge(first, second, size)    mmap_create(size, ptr)
+ *   sbrk(increment, old_break)     compact(moved_bytes, trimmed_bytes)
+ *   slide_down(old_ptr, new_ptr, size)
+ * e.g. bpftrace -e 'usdt:./prog:smalloc:path { @[str(arg0)] = count(); }' */
+#ifdef MALLOC_PROBES
+#define PROBE1(name, a) STAP_PROBE1(smalloc, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(smalloc, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(smalloc, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/* Path statistics (build with MALLOC_PATH_STATS): the *_unlocked functions mark
+ * the path they took with PATH_TAKEN and the locking wrappers charge the hit and
+ * the cycles spent under the lock to it. Without the flag it all compiles out,
+ * except for the path probe. */
+#if defined(MALLOC_PATH_STATS) || defined(MALLOC_PROBES)
+enum AllocPath {
+    PATH_FAILED,
+    PATH_SMALLOC_FAST_BIN,
+    PATH_SMALLOC_BIN,
+    PATH_SMALLOC_BIN_SPLIT,
+    PATH_SMALLOC_CONSOLIDATE,
+    PATH_SMALLOC_WILDERNESS,
+    PATH_SMALLOC_SBRK,
+    PATH_SMALLOC_MMAP,
+    PATH_SMALLOC_PAGES,
+    PATH_SFREE_FAST_BIN,
+    PATH_SFREE_MERGE,
+    PATH_SFREE_MUNMAP,
+    PATH_SFREE_REMOTE,
+    PATH_SFREE_PAGES,
+    PATH_SREALLOC_TAIL,
+    PATH_SREALLOC_IN_PLACE,
+    PATH_SREALLOC_MERGE_PREV,
+    PATH_SREALLOC_MERGE_NEXT,
+    PATH_SREALLOC_MERGE_BOTH,
+    PATH_SREALLOC_WILDERNESS,
+    PATH_SREALLOC_COPY,
+    PATH_SREALLOC_PAGES,
+    PATH_BATCH_ALLOC,
+    PATH_BATCH_FREE,
+    PATH_COUNT
+};
+
+static const char* path_names[PATH_COUNT] = {
+    "failed",
+    "smalloc_fast_bin",
+    "smalloc_bin",
+    "smalloc_bin_split",
+    "smalloc_consolidate",
+    "smalloc_wilderness",
+    "smalloc_sbrk",
+    "smalloc_mmap",
+    "smalloc_pages",
+    "sfree_fast_bin",
+    "sfree_merge",
+    "sfree_munmap",
+    "sfree_remote",
+    "sfree_pages",
+    "srealloc_tail",
+    "srealloc_in_place",
+    "srealloc_merge_prev",
+    "srealloc_merge_next",
+    "srealloc_merge_both",
+    "srealloc_wilderness",
+    "srealloc_copy",
+    "srealloc_pages",
+    "batch_alloc",
+    "batch_free",
+};
+#endif
+
+#ifdef MALLOC_PATH_STATS
+static size_t path_hits[PATH_COUNT] = {0};
+static unsigned long long path_cycles[PATH_COUNT] = {0};
+static AllocPath current_path = PATH_FAILED;
+
+static inline unsigned long long path_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+#define PATH_TAKEN(which) do { \
+        current_path = (which); \
+        PROBE1(path, path_names[current_path]); \
+    } while (0)
+#define PATH_TIMER_START() current_path = PATH_FAILED; unsigned long long path_start = path_clock()
+#define PATH_TIMER_STOP() do { \
+        path_hits[current_path]++; \
+        path_cycles[current_path] += path_clock() - path_start; \
+    } while (0)
+#else
+#define PATH_TAKEN(which) PROBE1(path, path_names[which])
+#define PATH_TIMER_START() ((void)0)
+#define PATH_TIMER_STOP() ((void)0)
+#endif
+
+/* Telemetry: the counters of malloc_4_telemetry.h live in local_telemetry until
+ * stelemetry_start moves them to the shared page. Writers hold the heap lock
+ * (remote frees are counted when the lock holder drains them), so the page
+ * can be unmapped under it, and store with relaxed atomics, so readers in other
+ * processes never see a torn value. */
+static STelemetry local_telemetry;
+static STelemetry* telemetry = &local_telemetry;
+
+#define TELEMETRY_ADD(field, n) __atomic_store_n(&telemetry->field, telemetry->field + (n), __ATOMIC_RELAXED)
+#define TELEMETRY_SUB(field, n) __atomic_store_n(&telemetry->field, telemetry->field - (n), __ATOMIC_RELAXED)
+
+/* Heap profile: once started, one allocation per sample_period bytes on average
+ * (exponentially distributed gaps, as in tcmalloc) has its stack recorded in
+ * heap_samples until it is freed. Sampled blocks carry is_sampled so sfree only
+ * looks the table up for them. The table is static, keyed by address with linear
+ * probing, and drops samples once it is three quarters full. */
+#define HEAP_PROFILE_DEFAULT_PERIOD (512 * 1024)
+#define HEAP_PROFILE_MAX_DEPTH 32
+#define HEAP_PROFILE_SLOTS 4096
+#define HEAP_PROFILE_MAX_SAMPLES (HEAP_PROFILE_SLOTS / 4 * 3)
+
+struct HeapSample {
+    void* address;
+    size_t size;
+    int depth;
+    void* stack[HEAP_PROFILE_MAX_DEPTH];
+};
+
+static bool heap_profile_enabled = false;
+static size_t heap_profile_period = HEAP_PROFILE_DEFAULT_PERIOD;
+static long long bytes_until_sample = 0;
+static unsigned long long heap_profile_rng = 88172645463325252ULL;
+static HeapSample heap_samples[HEAP_PROFILE_SLOTS];
+static size_t heap_samples_live = 0;
+static size_t heap_samples_dropped = 0;
+
+static long long next_sample_gap() {
+    heap_profile_rng ^= heap_profile_rng << 13;
+    heap_profile_rng ^= heap_profile_rng >> 7;
+    heap_profile_rng ^= heap_profile_rng << 17;
+    double uniform = ((heap_profile_rng >> 11) + 1) * (1.0 / 9007199254740993.0);
+    return (long long)(-log(uniform) * heap_profile_period) + 1;
+}
+
+// called with the heap lock held after every successful allocation
+static bool should_sample(size_t size) {
+    if (not heap_profile_enabled) {
+        return false;
+    }
+    bytes_until_sample -= size;
+    if (bytes_until_sample > 0) {
+        return false;
+    }
+    bytes_until_sample = next_sample_gap();
+    return true;
+}
+
+static bool* sampled_flag(void* address);
+
+static size_t sample_slot(void* address) {
+    return ((size_t)address >> 3) * 0x9E3779B97F4A7C15ULL >> 52 & (HEAP_PROFILE_SLOTS - 1);
+}
+
+static void sample_insert(void* address, size_t size, void** stack, int depth) {
+    if (heap_samples_live >= HEAP_PROFILE_MAX_SAMPLES) {
+        heap_samples_dropped++;
+        return;
+    }
+    size_t slot = sample_slot(address);
+    while (heap_samples[slot].address != nullptr) {
+        slot = (slot + 1) & (HEAP_PROFILE_SLOTS - 1);
+    }
+    heap_samples[slot].address = address;
+    heap_samples[slot].size = size;
+    heap_samples[slot].depth = depth;
+    memcpy(heap_samples[slot].stack, stack, depth * sizeof(void*));
+    heap_samples_live++;
+    *sampled_flag(address) = true;
+}
+
+static void sample_remove(void* address) {
+    *sampled_flag(address) = false;
+    size_t hole = sample_slot(address);
+    while (heap_samples[hole].address != address) {
+        if (heap_samples[hole].address == nullptr) {
+            return;
+        }
+        hole = (hole + 1) & (HEAP_PROFILE_SLOTS - 1);
+    }
+    // backward shift deletion keeps every probe sequence unbroken
+    size_t next = (hole + 1) & (HEAP_PROFILE_SLOTS - 1);
+    while (heap_samples[next].address != nullptr) {
+        size_t home = sample_slot(heap_samples[next].address);
+        if (((next - home) & (HEAP_PROFILE_SLOTS - 1)) >= ((next - hole) & (HEAP_PROFILE_SLOTS - 1))) {
+            heap_samples[hole] = heap_samples[next];
+            hole = next;
+        }
+        next = (next + 1) & (HEAP_PROFILE_SLOTS - 1);
+    }
+    heap_samples[hole].address = nullptr;
+    heap_samples_live--;
+}
+
+// copies the sample of address out before removing it, false when it has none
+static bool sample_take(void* address, HeapSample* taken) {
+    size_t slot = sample_slot(address);
+    while (heap_samples[slot].address != address) {
+        if (heap_samples[slot].address == nullptr) {
+            sample_remove(address);
+            return false;
+        }
+        slot = (slot + 1) & (HEAP_PROFILE_SLOTS - 1);
+    }
+    *taken = heap_samples[slot];
+    sample_remove(address);
+    return true;
+}
+
+// the stack is taken outside the heap lock, frame 0 is this function and frame 1 the public entry point
+__attribute__((noinline)) static void record_sample(void* address, size_t size) {
+    void* stack[HEAP_PROFILE_MAX_DEPTH + 2];
+    int depth = backtrace(stack, HEAP_PROFILE_MAX_DEPTH + 2) - 2;
+    if (depth < 0) {
+        depth = 0;
+    }
+    pthread_mutex_lock(&heap_lock);
+    if (heap_profile_enabled and sampled_flag(address) != nullptr) {
+        sample_insert(address, size, stack + 2, depth);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
 
 size_t _num_free_blocks();
 
-size_t _num_free_bytes();
+size_t _num_free_bytes();
+
+size_t _num_allocated_blocks();
+
+size_t _num_allocated_bytes();
+
+size_t _num_meta_data_bytes();
+
+size_t _size_meta_data();
+
+/* Page map: a three level radix tree, as in tcmalloc, from the page number of
+ * any address malloc_4 owns to the Span that covers it. The sbrk heap gets one
+ * span per contiguous stretch (heap_sbrk keeps it in sync with the program
+ * break) and every mmap block gets its own, so sfree and smalloc_usable_size
+ * find the owner and size of a pointer without trusting the bytes in front of
+ * it. Nodes and spans come straight from mmap and are never handed back. */
+
+#define PAGE_SHIFT 12
+#define PAGE_MAP_LEVEL_BITS 12
+#define PAGE_MAP_LEVEL_SIZE (1 << PAGE_MAP_LEVEL_BITS)
+#define SPAN_SLAB_SIZE (64 * KB)
+
+enum SpanKind {
+    SPAN_HEAP,
+    SPAN_MMAP,
+    SPAN_PAGES,      // a page heap allocation
+    SPAN_FREE_PAGES, // a free page heap run
+};
+
+struct Span {
+    size_t first_page;
+    size_t num_pages;
+    SpanKind kind;
+    bool is_sampled;       // heap profile flag of a SPAN_PAGES allocation, which has no header
+    char* end;             // first byte after the span
+    MallocMetadata* block; // the block of a SPAN_MMAP span
+    Span* next;            // every page heap span, free or not
+    Span* prev;
+    Span* next_free;       // free page heap runs of one length, or the descriptor pool
+    Span* prev_free;
+};
+
+struct PageMapNode {
+    void* entries[PAGE_MAP_LEVEL_SIZE];
+};
+
+static PageMapNode page_map_root;
+static Span* free_spans = nullptr;
+static Span* heap_span = nullptr;
+
+static size_t page_of(const void* address) {
+    return (uintptr_t)address >> PAGE_SHIFT;
+}
+
+static PageMapNode* page_map_node_create() {
+    void* node = mmap(NULL, sizeof(PageMapNode), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    TELEMETRY_ADD(mmap_calls, 1);
+    return node == (void*)(-1) ? nullptr : (PageMapNode*)node;
+}
+
+static Span* page_map_get(size_t page) {
+    PageMapNode* middle = (PageMapNode*)page_map_root.entries[(page >> (2 * PAGE_MAP_LEVEL_BITS)) % PAGE_MAP_LEVEL_SIZE];
+    if (middle == nullptr) {
+        return nullptr;
+    }
+    PageMapNode* leaf = (PageMapNode*)middle->entries[(page >> PAGE_MAP_LEVEL_BITS) % PAGE_MAP_LEVEL_SIZE];
+    if (leaf == nullptr) {
+        return nullptr;
+    }
+    return (Span*)leaf->entries[page % PAGE_MAP_LEVEL_SIZE];
+}
+
+// points pages [first_page, first_page + num_pages) at span, creating nodes on the way
+static bool page_map_set(size_t first_page, size_t num_pages, Span* span) {
+    for (size_t page = first_page; page < first_page + num_pages; ++page) {
+        void** middle = &page_map_root.entries[(page >> (2 * PAGE_MAP_LEVEL_BITS)) % PAGE_MAP_LEVEL_SIZE];
+        if (*middle == nullptr and (*middle = page_map_node_create()) == nullptr) {
+            return false;
+        }
+        void** leaf = &((PageMapNode*)*middle)->entries[(page >> PAGE_MAP_LEVEL_BITS) % PAGE_MAP_LEVEL_SIZE];
+        if (*leaf == nullptr and (*leaf = page_map_node_create()) == nullptr) {
+            return false;
+        }
+        ((PageMapNode*)*leaf)->entries[page % PAGE_MAP_LEVEL_SIZE] = span;
+    }
+    return true;
+}
+
+// gives a descriptor back to the pool, leaving the page map alone
+static void span_release(Span* span) {
+    span->next_free = free_spans;
+    free_spans = span;
+}
+
+static Span* span_create(SpanKind kind, char* start, char* end) {
+    if (free_spans == nullptr) {
+        void* slab = mmap(NULL, SPAN_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        TELEMETRY_ADD(mmap_calls, 1);
+        if (slab == (void*)(-1)) {
+            return nullptr;
+        }
+        for (Span* span = (Span*)slab; span + 1 <= (Span*)((char*)slab + SPAN_SLAB_SIZE); ++span) {
+            span_release(span);
+        }
+    }
+    Span* span = free_spans;
+    free_spans = span->next_free;
+    span->kind = kind;
+    span->is_sampled = false;
+    span->first_page = page_of(start);
+    span->num_pages = page_of(end - 1) - span->first_page + 1;
+    span->end = end;
+    span->block = nullptr;
+    span->next = nullptr;
+    span->prev = nullptr;
+    span->next_free = nullptr;
+    span->prev_free = nullptr;
+    if (not page_map_set(span->first_page, span->num_pages, span)) {
+        span_release(span);
+        return nullptr;
+    }
+    return span;
+}
+
+static void span_destroy(Span* span) {
+    page_map_set(span->first_page, span->num_pages, nullptr);
+    span_release(span);
+}
+
+#ifdef MALLOC_RESERVED_HEAP
+/* Reserved heap (build with MALLOC_RESERVED_HEAP): the heap leaves the program
+ * break alone and grows inside ranges reserved PROT_NONE with mmap. The pages
+ * under the break of the current range are committed with mprotect,
+ * RESERVED_COMMIT_SIZE at a time, and decommitted again when it moves down, so
+ * foreign sbrk calls cannot come between two blocks and growth never goes
+ * through brk. An increment that does not fit the range reserves a fresh one,
+ * which heap_sbrk sees as a new stretch, the same as after a foreign sbrk. */
+
+#define RESERVED_RANGE_SIZE ((size_t)1 << 30)
+#define RESERVED_COMMIT_SIZE ((uintptr_t)64 * KB)
+
+static char* reserved_break = nullptr;
+static char* reserved_committed = nullptr;
+static char* reserved_end = nullptr;
+
+static char* commit_ceil(char* address) {
+    char* ceil = (char*)(((uintptr_t)address + RESERVED_COMMIT_SIZE - 1) & ~(RESERVED_COMMIT_SIZE - 1));
+    return ceil < reserved_end ? ceil : reserved_end;
+}
+
+static void* raw_sbrk(intptr_t increment) {
+    if (increment > 0 and (reserved_break == nullptr or (size_t)increment > (size_t)(reserved_end - reserved_break))) {
+        size_t whole_pages = ((size_t)increment + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT << PAGE_SHIFT;
+        size_t size = whole_pages > RESERVED_RANGE_SIZE ? whole_pages : RESERVED_RANGE_SIZE;
+        void* range = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        TELEMETRY_ADD(mmap_calls, 1);
+        if (range == MAP_FAILED) {
+            return (void*)(-1);
+        }
+        reserved_break = (char*)range;
+        reserved_committed = (char*)range;
+        reserved_end = (char*)range + size;
+    }
+    char* old_break = reserved_break;
+    char* new_break = old_break + increment;
+    if (new_break > reserved_committed) {
+        char* commit_end = commit_ceil(new_break);
+        TELEMETRY_ADD(mprotect_calls, 1);
+        if (mprotect(reserved_committed, commit_end - reserved_committed, PROT_READ | PROT_WRITE) != 0) {
+            return (void*)(-1);
+        }
+        reserved_committed = commit_end;
+    } else if (increment < 0 and commit_ceil(new_break) < reserved_committed) {
+        // mapping PROT_NONE over the pages drops them along with the access
+        char* keep = commit_ceil(new_break);
+        TELEMETRY_ADD(mmap_calls, 1);
+        if (mmap(keep, reserved_committed - keep, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            return (void*)(-1);
+        }
+        reserved_committed = keep;
+    }
+    reserved_break = new_break;
+    PROBE2(sbrk, increment, old_break);
+    return old_break;
+}
+#else
+static void* raw_sbrk(intptr_t increment) {
+    if (increment == 0) {
+        return sbrk(0);
+    }
+    TELEMETRY_ADD(sbrk_calls, 1);
+    void* old_break = sbrk(increment);
+    PROBE2(sbrk, increment, old_break);
+    return old_break;
+}
+#endif
+
+// sbrk that keeps the heap spans in the page map in step with the program break
+static void* heap_sbrk(intptr_t increment) {
+    char* old_break = (char*)raw_sbrk(increment);
+    if (old_break == (char*)(-1) or increment == 0) {
+        return old_break;
+    }
+    char* new_break = old_break + increment;
+    if (increment < 0) {
+        if (heap_span != nullptr and heap_span->end == old_break) {
+            size_t kept_pages = page_of(new_break - 1) + 1 - heap_span->first_page;
+            page_map_set(heap_span->first_page + kept_pages, heap_span->num_pages - kept_pages, nullptr);
+            heap_span->num_pages = kept_pages;
+            heap_span->end = new_break;
+        }
+        TELEMETRY_ADD(heap_bytes, increment);
+        return old_break;
+    }
+    if (heap_span != nullptr and heap_span->end == old_break) { // the heap grew in place
+        size_t last_page = page_of(new_break - 1);
+        size_t mapped_pages = heap_span->first_page + heap_span->num_pages;
+        if (last_page >= mapped_pages and not page_map_set(mapped_pages, last_page + 1 - mapped_pages, heap_span)) {
+            raw_sbrk(-increment);
+            return (void*)(-1);
+        }
+        heap_span->num_pages = last_page + 1 - heap_span->first_page;
+        heap_span->end = new_break;
+        TELEMETRY_ADD(heap_bytes, increment);
+        return old_break;
+    }
+    // someone else moved the break, the heap goes on in a new stretch
+    Span* span = span_create(SPAN_HEAP, old_break, new_break);
+    if (span == nullptr) {
+        raw_sbrk(-increment);
+        return (void*)(-1);
+    }
+    heap_span = span;
+    TELEMETRY_ADD(heap_bytes, increment);
+    return old_break;
+}
+
+/* Page heap: allocations from PAGE_HEAP_MIN_SIZE up to MMAP_MIN_SIZE take a
+ * run of whole pages instead of a heap block, so they neither sit among the
+ * small objects nor carry a header; their span in the page map holds the
+ * length. Free runs are kept in page_heap_free_lists by length in pages (the
+ * last list takes every longer run, first fit), merge with the free runs next
+ * to them, and anything above PAGE_HEAP_GROW_PAGES free pages in total is
+ * unmapped as soon as a run that long comes free. */
+
+#define PAGE_BYTES ((size_t)1 << PAGE_SHIFT)
+#define PAGE_HEAP_MIN_SIZE (4 * KB)
+#define PAGE_HEAP_MAX_PAGES (MMAP_MIN_SIZE / PAGE_BYTES)
+#define PAGE_HEAP_LISTS (PAGE_HEAP_MAX_PAGES + 2)
+#define PAGE_HEAP_GROW_PAGES 256
+
+static Span* page_spans = nullptr;
+static Span* page_heap_free_lists[PAGE_HEAP_LISTS] = {nullptr};
+static size_t page_heap_free_pages = 0;
+
+static char* span_start(Span* span) {
+    return (char*)(span->first_page << PAGE_SHIFT);
+}
+
+static bool is_page_object(Span* span, void* address) {
+    return span != nullptr and span->kind == SPAN_PAGES and address == span_start(span);
+}
+
+static size_t pages_for(size_t size) {
+    return (size + PAGE_BYTES - 1) >> PAGE_SHIFT;
+}
+
+static size_t page_list_index(size_t num_pages) {
+    return num_pages <= PAGE_HEAP_MAX_PAGES ? num_pages : PAGE_HEAP_LISTS - 1;
+}
+
+static void page_list_insert(Span* span) {
+    size_t index = page_list_index(span->num_pages);
+    span->prev_free = nullptr;
+    span->next_free = page_heap_free_lists[index];
+    if (span->next_free != nullptr) {
+        span->next_free->prev_free = span;
+    }
+    page_heap_free_lists[index] = span;
+    page_heap_free_pages += span->num_pages;
+    TELEMETRY_ADD(page_free_runs, 1);
+    TELEMETRY_ADD(page_free_bytes, span->num_pages * PAGE_BYTES);
+}
+
+static void page_list_remove(Span* span) {
+    if (span->prev_free != nullptr) {
+        span->prev_free->next_free = span->next_free;
+    } else {
+        page_heap_free_lists[page_list_index(span->num_pages)] = span->next_free;
+    }
+    if (span->next_free != nullptr) {
+        span->next_free->prev_free = span->prev_free;
+    }
+    span->next_free = nullptr;
+    span->prev_free = nullptr;
+    page_heap_free_pages -= span->num_pages;
+    TELEMETRY_SUB(page_free_runs, 1);
+    TELEMETRY_SUB(page_free_bytes, span->num_pages * PAGE_BYTES);
+}
+
+static void page_spans_link(Span* span) {
+    span->prev = nullptr;
+    span->next = page_spans;
+    if (page_spans != nullptr) {
+        page_spans->prev = span;
+    }
+    page_spans = span;
+    TELEMETRY_ADD(page_runs, 1);
+}
+
+static void page_spans_unlink(Span* span) {
+    if (span->prev != nullptr) {
+        span->prev->next = span->next;
+    } else {
+        page_spans = span->next;
+    }
+    if (span->next != nullptr) {
+        span->next->prev = span->prev;
+    }
+    TELEMETRY_SUB(page_runs, 1);
+}
+
+// moves the pages of second, which must follow first, over to first
+static void page_span_absorb(Span* first, Span* second) {
+    page_map_set(second->first_page, second->num_pages, first);
+    first->num_pages += second->num_pages;
+    first->end = second->end;
+    page_spans_unlink(second);
+    span_release(second);
+}
+
+static void page_heap_free(Span* span) {
+    span->kind = SPAN_FREE_PAGES;
+    span->is_sampled = false;
+    Span* before = page_map_get(span->first_page - 1);
+    if (before != nullptr and before->kind == SPAN_FREE_PAGES) {
+        page_list_remove(before);
+        page_span_absorb(before, span);
+        span = before;
+    }
+    Span* after = page_map_get(span->first_page + span->num_pages);
+    if (after != nullptr and after->kind == SPAN_FREE_PAGES) {
+        page_list_remove(after);
+        page_span_absorb(span, after);
+    }
+    size_t total_free_pages = page_heap_free_pages + span->num_pages;
+    if (not decay_running and span->num_pages >= PAGE_HEAP_GROW_PAGES and total_free_pages > PAGE_HEAP_GROW_PAGES) {
+        size_t released = total_free_pages - PAGE_HEAP_GROW_PAGES;
+        released = released < span->num_pages ? released : span->num_pages;
+        char* from = span->end - released * PAGE_BYTES;
+        page_map_set(page_of(from), released, nullptr);
+        munmap(from, released * PAGE_BYTES);
+        TELEMETRY_ADD(munmap_calls, 1);
+        TELEMETRY_SUB(page_bytes, released * PAGE_BYTES);
+        span->num_pages -= released;
+        span->end = from;
+        if (span->num_pages == 0) {
+            page_spans_unlink(span);
+            span_release(span);
+            return;
+        }
+    }
+    page_list_insert(span);
+}
+
+// cuts an allocated span down to num_pages and frees the rest
+static bool page_heap_trim(Span* span, size_t num_pages) {
+    if (span->num_pages == num_pages) {
+        return true;
+    }
+    Span* rest = span_create(SPAN_FREE_PAGES, span_start(span) + num_pages * PAGE_BYTES, span->end);
+    if (rest == nullptr) {
+        return false;
+    }
+    page_spans_link(rest);
+    span->num_pages = num_pages;
+    span->end = span_start(span) + num_pages * PAGE_BYTES;
+    page_heap_free(rest);
+    return true;
+}
+
+static Span* page_heap_alloc(size_t num_pages) {
+    Span* span = nullptr;
+    for (size_t index = page_list_index(num_pages); index < PAGE_HEAP_LISTS and span == nullptr; index++) {
+        for (Span* curr = page_heap_free_lists[index]; curr != nullptr; curr = curr->next_free) {
+            if (curr->num_pages >= num_pages) {
+                span = curr;
+                break;
+            }
+        }
+    }
+    if (span != nullptr) {
+        page_list_remove(span);
+    } else {
+        size_t grow = num_pages > PAGE_HEAP_GROW_PAGES ? num_pages : PAGE_HEAP_GROW_PAGES;
+        void* segment = mmap(NULL, grow * PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        TELEMETRY_ADD(mmap_calls, 1);
+        if (segment == (void*)(-1)) {
+            return nullptr;
+        }
+        span = span_create(SPAN_FREE_PAGES, (char*)segment, (char*)segment + grow * PAGE_BYTES);
+        if (span == nullptr) {
+            munmap(segment, grow * PAGE_BYTES);
+            TELEMETRY_ADD(munmap_calls, 1);
+            return nullptr;
+        }
+        page_spans_link(span);
+        TELEMETRY_ADD(page_bytes, grow * PAGE_BYTES);
+    }
+    span->kind = SPAN_PAGES;
+    span->is_sampled = false;
+    if (not page_heap_trim(span, num_pages)) {
+        page_heap_free(span);
+        return nullptr;
+    }
+    return span;
+}
+
+// where the heap profile flag of an allocation lives, nullptr once its memory is gone
+static bool* sampled_flag(void* address) {
+    Span* span = page_map_get(page_of(address));
+    if (span == nullptr) {
+        return nullptr;
+    }
+    if (is_page_object(span, address)) {
+        return &span->is_sampled;
+    }
+    return &((MallocMetadata*)address - 1)->is_sampled;
+}
+
+static size_t aligned_size(size_t old_size){
+    return (old_size + MALLOC_ALIGNMENT - 1) & ~(size_t)(MALLOC_ALIGNMENT - 1);
+}
+
+static size_t bin_index(size_t size) {
+    size_t index = size / KB;
+    return index < BIN_MAX_SIZE ? index : BIN_MAX_SIZE - 1;
+}
+
+static void bin_insert(MallocMetadata* block) {
+    size_t index = bin_index(block->size);
+    block->is_purged = false;
+    block->prev_free = nullptr;
+    block->next_free = free_bins[index];
+    if (free_bins[index] != nullptr) {
+        free_bins[index]->prev_free = block;
+    }
+    free_bins[index] = block;
+    TELEMETRY_ADD(bin_blocks[index], 1);
+    TELEMETRY_ADD(bin_bytes[index], block->size);
+}
+
+static void bin_remove(MallocMetadata* block) {
+    size_t index = bin_index(block->size);
+    if (block->prev_free != nullptr) {
+        block->prev_free->next_free = block->next_free;
+    } else if (free_bins[index] == block) {
+        free_bins[index] = block->next_free;
+    } else { // not in any bin
+        return;
+    }
+    if (block->next_free != nullptr) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+    TELEMETRY_SUB(bin_blocks[index], 1);
+    TELEMETRY_SUB(bin_bytes[index], block->size);
+}
+
+static bool is_mergeable(MallocMetadata* block) {
+    return block != nullptr and block->is_free and not block->in_fast_bin;
+}
+
+// blocks on either side of a gap in the heap (a foreign sbrk, a new reserved range) never merge
+static bool adjacent(MallocMetadata* first, MallocMetadata* second) {
+    return (char*)first->address + first->size == (char*)second;
+}
+
+static bool merge(MallocMetadata* first , MallocMetadata* second){
+    if (not is_mergeable(first) or not is_mergeable(second) or not adjacent(first, second)) {
+        return false;
+    }
+    bin_remove(first);
+    bin_remove(second);
+    first->size += second->size + _size_meta_data();
+    TELEMETRY_SUB(heap_blocks, 1);
+    first->next = second->next;
+    if (second->next != nullptr) {
+        second->next->prev = first;
+    }
+    if (list_block_tail == second) {
+        list_block_tail = first;
+    }
+    PROBE3(merge, first->address, second->address, first->size);
+    return true;
+}
+
+static void split_block(size_t size, MallocMetadata* block_to_split) {
+    if (block_to_split->size < MIN_SPLIT + size + _size_meta_data()) {
+        return;
+    }
+    size_t size_left = block_to_split->size - size - _size_meta_data();
+    PROBE3(split_block, block_to_split->address, size, size_left);
+    block_to_split->size = size;
+    TELEMETRY_ADD(heap_blocks, 1);
+    void * temp = static_cast<char*>(block_to_split->address) + size;
+    MallocMetadata * new_metadata = static_cast<MallocMetadata*>(temp);
+    new_metadata->address = static_cast<char*>(temp) + _size_meta_data();
+    new_metadata->size = size_left;
+    MallocMetadata * tmp =  block_to_split->next;
+    new_metadata->next = tmp;
+    new_metadata->prev = block_to_split;
+    if (block_to_split->next != nullptr) {
+        block_to_split->next->prev = new_metadata;
+    }
+    block_to_split->next = new_metadata;
+    if (block_to_split == list_block_tail) {
+        list_block_tail = new_metadata;
+    }
+    new_metadata->is_free = true;
+    new_metadata->is_region = false;
+    new_metadata->in_fast_bin = false;
+    new_metadata->is_sampled = false;
+    new_metadata->handle = nullptr;
+    new_metadata->is_purged = false;
+    new_metadata->next_free = nullptr;
+    new_metadata->prev_free = nullptr;
+    merge(new_metadata, new_metadata->next); // a shrinking srealloc can leave a free block behind it
+    bin_insert(new_metadata);
+}
+
+static MallocMetadata *merge_free (MallocMetadata* block_to_merge) {
+    merge(block_to_merge , block_to_merge->next);
+    if (merge(block_to_merge->prev, block_to_merge)) {
+        return block_to_merge->prev;
+    }
+    return block_to_merge;
+}
+
+static void consolidate_fast_bins() {
+    for (size_t index = 0; index < FAST_BINS; index++) {
+        MallocMetadata* block = fast_bins[index];
+        fast_bins[index] = nullptr;
+        while (block) {
+            MallocMetadata* next = block->next_free;
+            block->in_fast_bin = false;
+            block->next_free = nullptr;
+            bin_insert(merge_free(block));
+            block = next;
+        }
+    }
+    fast_bin_bytes = 0;
+    TELEMETRY_SUB(fast_bin_blocks, telemetry->fast_bin_blocks);
+    TELEMETRY_SUB(fast_bin_bytes, telemetry->fast_bin_bytes);
+}
+
+static void* mmap_create (size_t size) {
+    void* new_mmap = mmap(NULL, size + _size_meta_data(), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    TELEMETRY_ADD(mmap_calls, 1);
+    if (new_mmap == (void*)(-1)) {
+        return NULL;
+    }
+    Span* span = span_create(SPAN_MMAP, (char*)new_mmap, (char*)new_mmap + size + _size_meta_data());
+    if (span == nullptr) {
+        munmap(new_mmap, size + _size_meta_data());
+        TELEMETRY_ADD(munmap_calls, 1);
+        return NULL;
+    }
+    TELEMETRY_ADD(mmap_blocks, 1);
+    TELEMETRY_ADD(mmap_bytes, size);
+    span->block = (MallocMetadata*)new_mmap;
+    ((MallocMetadata*) new_mmap)->size = size;
+    ((MallocMetadata*) new_mmap)->is_free = false;
+    ((MallocMetadata*) new_mmap)->is_region = false;
+    ((MallocMetadata*) new_mmap)->in_fast_bin = false;
+    ((MallocMetadata*) new_mmap)->is_sampled = false;
+    ((MallocMetadata*) new_mmap)->handle = nullptr;
+    ((MallocMetadata*) new_mmap)->is_purged = false;
+    ((MallocMetadata*) new_mmap)->address = (void*)((char*)new_mmap + _size_meta_data());
+    ((MallocMetadata*) new_mmap)->next_free = nullptr;
+    ((MallocMetadata*) new_mmap)->prev_free = nullptr;
+    if (mmap_list_block_head == nullptr){ //case list empty
+        mmap_list_block_head = (MallocMetadata*) new_mmap;
+        mmap_list_block_head->next = nullptr;
+        mmap_list_block_head->prev = nullptr;
+        mmap_list_block_tail = mmap_list_block_head;
+    } else { // new element added to last place
+        /*update prev and next*/
+        mmap_list_block_tail->next = (MallocMetadata*) new_mmap;
+        ((MallocMetadata*) new_mmap)->next = nullptr;
+        ((MallocMetadata*) new_mmap)->prev = mmap_list_block_tail;
+        mmap_list_block_tail = ((MallocMetadata*) new_mmap);
+    }
+    PROBE2(mmap_create, size, ((MallocMetadata*) new_mmap)->address);
+    return ((MallocMetadata*) new_mmap)->address;
+}
+
+static void* sbrk_create (size_t size) {
+    size_t misalignment = (uintptr_t)raw_sbrk(0) % MALLOC_ALIGNMENT;
+    if (misalignment != 0) {
+        if (heap_sbrk(MALLOC_ALIGNMENT - misalignment) == (void*)(-1)) {
+            return NULL;
+        }
+        TELEMETRY_ADD(heap_padding_bytes, MALLOC_ALIGNMENT - misalignment);
+    }
+    void* prev_prog_break = heap_sbrk(size + _size_meta_data());
+    if (prev_prog_break == (void*)(-1)) {
+        return NULL;
+    }
+    TELEMETRY_ADD(heap_blocks, 1);
+    ((MallocMetadata*) prev_prog_break)->size = size;
+    ((MallocMetadata*) prev_prog_break)->is_free = false;
+    ((MallocMetadata*) prev_prog_break)->is_region = false;
+    ((MallocMetadata*) prev_prog_break)->in_fast_bin = false;
+    ((MallocMetadata*) prev_prog_break)->is_sampled = false;
+    ((MallocMetadata*) prev_prog_break)->handle = nullptr;
+    ((MallocMetadata*) prev_prog_break)->is_purged = false;
+    ((MallocMetadata*) prev_prog_break)->address = static_cast<char*>(prev_prog_break) + _size_meta_data();
+    ((MallocMetadata*) prev_prog_break)->next_free = nullptr;
+    ((MallocMetadata*) prev_prog_break)->prev_free = nullptr;
+    if (list_block_head == nullptr){ //case list empty
+        list_block_head = (MallocMetadata*) prev_prog_break;
+        list_block_head->next = nullptr;
+        list_block_head->prev = nullptr;
+        list_block_tail = list_block_head;
+    } else { // new element added to last place
+        /*update prev and next*/
+        list_block_tail->next = (MallocMetadata*) prev_prog_break;
+        ((MallocMetadata*) prev_prog_break)->next = nullptr;
+        ((MallocMetadata*) prev_prog_break)->prev = list_block_tail;
+        list_block_tail = ((MallocMetadata*) prev_prog_break);
+    }
+    return ((MallocMetadata*) prev_prog_break)->address;
+}
+
+/* Moves the break by increment when it sits right behind list_block_tail, so the
+ * tail block can grow or shrink in place; false when it does not or sbrk fails. */
+static bool tail_sbrk(intptr_t increment) {
+    char* tail_end = (char*)list_block_tail->address + list_block_tail->size;
+    if (raw_sbrk(0) != tail_end) {
+        return false;
+    }
+    char* old_break = (char*)heap_sbrk(increment);
+    if (old_break == (char*)(-1)) {
+        return false;
+    }
+    if (old_break != tail_end) { // the heap went on in a new stretch
+        heap_sbrk(-increment);
+        return false;
+    }
+    return true;
+}
+
+static void* bins_take(size_t size) {
+    size_t index = bin_index(size);
+    MallocMetadata* first_in_bin;
+    for (; index < BIN_MAX_SIZE; index++) {
+        first_in_bin = free_bins[index];
+        while (first_in_bin) {
+            if (first_in_bin->size >= size) {
+                bin_remove(first_in_bin);
+                first_in_bin->is_free = false;
+                PATH_TAKEN(first_in_bin->size < size + MIN_SPLIT + _size_meta_data() ? PATH_SMALLOC_BIN : PATH_SMALLOC_BIN_SPLIT);
+                split_block(size, first_in_bin);
+                return first_in_bin->address;
+            }
+            first_in_bin = first_in_bin->next_free;
+        }
+    }
+    return NULL;
+}
+
+static void* smalloc_unlocked(size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (size_aligned >= MMAP_MIN_SIZE) {
+        PATH_TAKEN(PATH_SMALLOC_MMAP);
+        return mmap_create(size_aligned);
+    }
+    if (size_aligned >= PAGE_HEAP_MIN_SIZE) {
+        Span* span = page_heap_alloc(pages_for(size_aligned));
+        if (span == nullptr) {
+            return NULL;
+        }
+        PATH_TAKEN(PATH_SMALLOC_PAGES);
+        return span_start(span);
+    }
+    if (size_aligned <= FAST_BIN_MAX_SIZE and fast_bins[size_aligned / 8] != nullptr) {
+        MallocMetadata* block = fast_bins[size_aligned / 8];
+        fast_bins[size_aligned / 8] = block->next_free;
+        fast_bin_bytes -= block->size;
+        TELEMETRY_SUB(fast_bin_blocks, 1);
+        TELEMETRY_SUB(fast_bin_bytes, block->size);
+        block->next_free = nullptr;
+        block->in_fast_bin = false;
+        block->is_free = false;
+        PATH_TAKEN(PATH_SMALLOC_FAST_BIN);
+        return block->address;
+    }
+    void* address = bins_take(size_aligned);
+    if (address == NULL and fast_bin_bytes > 0) { // miss, merge the fast bins and retry
+        consolidate_fast_bins();
+        address = bins_take(size_aligned);
+        PATH_TAKEN(PATH_SMALLOC_CONSOLIDATE);
+    }
+    if (address != NULL) {
+        return address;
+    }
+    if (is_mergeable(list_block_tail) and tail_sbrk(size_aligned - list_block_tail->size)) {
+        bin_remove(list_block_tail);
+        list_block_tail->is_free = false;
+        list_block_tail->size = size_aligned;
+        PATH_TAKEN(PATH_SMALLOC_WILDERNESS);
+        return (void*)list_block_tail->address;
+    }
+    PATH_TAKEN(PATH_SMALLOC_SBRK);
+    return sbrk_create(size_aligned);
+}
+
+/* Alignments up to MALLOC_ALIGNMENT are what smalloc gives anyway. A larger one
+ * takes a page run (page aligned) once the padding would reach the page heap
+ * anyway, and otherwise a heap block with room for the padding, whose leading
+ * part is split off as a free block of its own. */
+static void* smemalign_unlocked(size_t alignment, size_t size) {
+    if (alignment <= MALLOC_ALIGNMENT) {
+        return smalloc_unlocked(size);
+    }
+    size_t size_aligned = aligned_size(size);
+    if (alignment > PAGE_BYTES or size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (size_aligned + alignment + _size_meta_data() >= PAGE_HEAP_MIN_SIZE) {
+        Span* span = page_heap_alloc(pages_for(size_aligned));
+        if (span == nullptr) {
+            return NULL;
+        }
+        PATH_TAKEN(PATH_SMALLOC_PAGES);
+        return span_start(span);
+    }
+    char* address = (char*)smalloc_unlocked(size_aligned + alignment + _size_meta_data());
+    if (address == NULL) {
+        return NULL;
+    }
+    MallocMetadata* block = (MallocMetadata*)address - 1;
+    if ((uintptr_t)address % alignment != 0) {
+        // the first aligned address that leaves room for the leading block's header
+        uintptr_t target = ((uintptr_t)address + _size_meta_data() + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        size_t gap = (char*)target - address;
+        MallocMetadata* moved = (MallocMetadata*)target - 1;
+        moved->size = block->size - gap;
+        moved->is_free = false;
+        moved->is_region = false;
+        moved->in_fast_bin = false;
+        moved->is_sampled = false;
+        moved->handle = nullptr;
+        moved->is_purged = false;
+        moved->address = (void*)target;
+        moved->next_free = nullptr;
+        moved->prev_free = nullptr;
+        moved->next = block->next;
+        moved->prev = block;
+        if (block->next != nullptr) {
+            block->next->prev = moved;
+        }
+        block->next = moved;
+        if (block == list_block_tail) {
+            list_block_tail = moved;
+        }
+        TELEMETRY_ADD(heap_blocks, 1);
+        block->size = gap - _size_meta_data();
+        block->is_free = true;
+        bin_insert(merge_free(block));
+        block = moved;
+    }
+    split_block(size_aligned, block);
+    return block->address;
+}
+
+void* scalloc(size_t num, size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or num > MAX_SIZE / size_aligned) {
+        return NULL;
+    }
+    void* prev_prog_break = smalloc(num * size_aligned);
+    if (prev_prog_break == NULL) {
+        return NULL;
+    }
+    void* curr = prev_prog_break;
+    memset(curr, 0, num * size_aligned);
+    return prev_prog_break;
+}
+
+// frees a block of the sbrk heap, which sfree_sized reaches without the page map
+static void sfree_heap_block(MallocMetadata* tmp) {
+    if (tmp->is_sampled) {
+        sample_remove(tmp->address);
+    }
+    tmp->is_free = true;
+    if (tmp->size <= FAST_BIN_MAX_SIZE) {
+        PATH_TAKEN(PATH_SFREE_FAST_BIN);
+        tmp->in_fast_bin = true;
+        tmp->next_free = fast_bins[tmp->size / 8];
+        fast_bins[tmp->size / 8] = tmp;
+        fast_bin_bytes += tmp->size;
+        TELEMETRY_ADD(fast_bin_blocks, 1);
+        TELEMETRY_ADD(fast_bin_bytes, tmp->size);
+        if (fast_bin_bytes > FAST_BIN_CONSOLIDATION_THRESHOLD) {
+            consolidate_fast_bins();
+        }
+        return;
+    }
+    PATH_TAKEN(PATH_SFREE_MERGE);
+    tmp = merge_free(tmp);
+    bin_insert(tmp);
+}
+
+static void sfree_unlocked(void* p) {
+    if (p == NULL){
+        return;
+    }
+    Span* span = page_map_get(page_of(p));
+    if (span == nullptr) { // not from this heap
+        return;
+    }
+    if (is_page_object(span, p)) {
+        if (span->is_sampled) {
+            sample_remove(p);
+        }
+        page_heap_free(span);
+        PATH_TAKEN(PATH_SFREE_PAGES);
+        return;
+    }
+    MallocMetadata* tmp = (MallocMetadata*)p;
+    tmp--;
+    if (tmp->is_region) { // released together with its region
+        return;
+    }
+    if (span->kind != SPAN_MMAP) {
+        sfree_heap_block(tmp);
+        return;
+    }
+    if (tmp->is_sampled) {
+        sample_remove(p);
+    }
+    tmp->is_free = true;
+    tmp = span->block;
+    span_destroy(span);
+    if (tmp == mmap_list_block_tail) {
+        mmap_list_block_tail = tmp->prev;
+    }
+    if (tmp == mmap_list_block_head) {
+        mmap_list_block_head = tmp->next;
+    }
+    if (tmp->next != nullptr) {
+        tmp->next->prev = tmp->prev;
+    }
+    if (tmp->prev != nullptr) {
+        tmp->prev->next = tmp->next;
+    }
+    TELEMETRY_SUB(mmap_blocks, 1);
+    TELEMETRY_SUB(mmap_bytes, tmp->size);
+    TELEMETRY_ADD(munmap_calls, 1);
+    munmap((void*)tmp, tmp->size + _size_meta_data());
+    PATH_TAKEN(PATH_SFREE_MUNMAP);
+}
+
+static void* resize_block(void* oldp, size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (oldp == NULL) {
+        return smalloc_unlocked(size_aligned);
+    }
+    Span* span = page_map_get(page_of(oldp));
+    if (is_page_object(span, oldp)) {
+        size_t num_pages = pages_for(size_aligned);
+        if (size_aligned >= PAGE_HEAP_MIN_SIZE and size_aligned < MMAP_MIN_SIZE) {
+            Span* after = page_map_get(span->first_page + span->num_pages);
+            if (num_pages > span->num_pages and after != nullptr and after->kind == SPAN_FREE_PAGES and
+                span->num_pages + after->num_pages >= num_pages) {
+                page_list_remove(after);
+                page_span_absorb(span, after);
+            }
+            if (num_pages <= span->num_pages and page_heap_trim(span, num_pages)) {
+                PATH_TAKEN(PATH_SREALLOC_PAGES);
+                return oldp;
+            }
+        }
+        size_t old_bytes = span->num_pages * PAGE_BYTES;
+        void* new_block = smalloc_unlocked(size_aligned);
+        if (new_block != NULL) {
+            memmove(new_block, oldp, size_aligned < old_bytes ? size_aligned : old_bytes);
+            page_heap_free(span);
+            PATH_TAKEN(PATH_SREALLOC_COPY);
+        }
+        return new_block;
+    }
+    MallocMetadata* oldp_meta_data = (MallocMetadata*)oldp;
+    oldp_meta_data--;
+    MallocMetadata* temp = nullptr;
+    size_t old_size = oldp_meta_data->size;
+    if (oldp_meta_data->is_region) { // region blocks never move, copy out
+        void* new_block = smalloc_unlocked(size_aligned);
+        if (new_block != NULL) {
+            memmove(new_block, oldp, size_aligned < old_size ? size_aligned : old_size);
+        }
+        PATH_TAKEN(PATH_SREALLOC_COPY);
+        return new_block;
+    }
+    if (size_aligned < MMAP_MIN_SIZE and old_size < MMAP_MIN_SIZE) {
+        if (oldp_meta_data == list_block_tail and tail_sbrk(size_aligned - list_block_tail->size)) {
+            list_block_tail->size = size_aligned;
+            PATH_TAKEN(PATH_SREALLOC_TAIL);
+            return list_block_tail->address;
+        }
+        PATH_TAKEN(PATH_SREALLOC_IN_PLACE);
+        oldp_meta_data->is_free = true;
+        if (oldp_meta_data->size < size_aligned) {
+            if (oldp_meta_data->prev != nullptr and
+                is_mergeable(oldp_meta_data->prev) and
+                oldp_meta_data->size + oldp_meta_data->prev->size >= size_aligned) {
+                if (merge(oldp_meta_data->prev, oldp_meta_data)) {
+                    PATH_TAKEN(PATH_SREALLOC_MERGE_PREV);
+                    temp = oldp_meta_data;
+                    oldp_meta_data = oldp_meta_data->prev;
+                }
+            } else if (oldp_meta_data->next != nullptr and
+                       is_mergeable(oldp_meta_data->next) and
+                       oldp_meta_data->size + oldp_meta_data->next->size >= size_aligned) {
+                merge(oldp_meta_data, oldp_meta_data->next);
+                PATH_TAKEN(PATH_SREALLOC_MERGE_NEXT);
+            }
+            else if (oldp_meta_data->next != nullptr and oldp_meta_data->prev != nullptr and
+                     is_mergeable(oldp_meta_data->next) and is_mergeable(oldp_meta_data->prev) and
+                     oldp_meta_data->size + oldp_meta_data->next->size + oldp_meta_data->prev->size >= size_aligned) {
+                temp = oldp_meta_data;
+                oldp_meta_data = merge_free(oldp_meta_data);
+                PATH_TAKEN(PATH_SREALLOC_MERGE_BOTH);
+            }
+        }
+        oldp_meta_data->is_free = false;
+        if (oldp_meta_data->size >= size_aligned) {
+            if (temp != nullptr) { // move the data before split_block writes a header into it
+                memmove(oldp_meta_data->address, oldp, old_size);
+            }
+            split_block(size_aligned, oldp_meta_data);
+            return oldp_meta_data->address;
+        }
+        if (is_mergeable(list_block_tail) and tail_sbrk(size_aligned - list_block_tail->size)) {
+            bin_remove(list_block_tail);
+            list_block_tail->is_free = false;
+            list_block_tail->size = size_aligned;
+            memmove(list_block_tail->address, oldp, old_size);
+            sfree_unlocked((void*)oldp);
+            PATH_TAKEN(PATH_SREALLOC_WILDERNESS);
+            return list_block_tail->address;
+        }
+    }
+    void* prev_prog_break = smalloc_unlocked(size_aligned);
+    if (prev_prog_break != NULL) {
+        memmove(prev_prog_break, oldp, size_aligned < old_size ? size_aligned : old_size);
+        sfree_unlocked((void*)oldp);
+        PATH_TAKEN(PATH_SREALLOC_COPY);
+    }
+    return prev_prog_break;
+}
+
+// the wrapper samples the resized block afresh, a block that stays put keeps its old sample
+static void* srealloc_unlocked(void* oldp, size_t size) {
+    HeapSample taken;
+    bool* sampled = oldp != NULL ? sampled_flag(oldp) : nullptr;
+    bool was_sampled = sampled != nullptr and *sampled and sample_take(oldp, &taken);
+    void* address = resize_block(oldp, size);
+    if (address == NULL and was_sampled) {
+        sample_insert(oldp, taken.size, taken.stack, taken.depth);
+    }
+    return address;
+}
+
+/* Batches: smalloc_batch carves n equal small blocks out of a single free block
+ * or heap extension, and takes larger ones a span or mapping at a time;
+ * sfree_batch coalesces each run of neighbours only once. */
+
+static void carve_blocks(MallocMetadata* block, size_t size, size_t n, void** out) {
+    MallocMetadata* after = block->next;
+    size_t total_size = block->size;
+    MallocMetadata* curr = block;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0) {
+            MallocMetadata* prev = curr;
+            curr = (MallocMetadata*)(static_cast<char*>(prev->address) + size);
+            curr->address = static_cast<char*>((void*)curr) + _size_meta_data();
+            curr->prev = prev;
+            prev->next = curr;
+            TELEMETRY_ADD(heap_blocks, 1);
+        }
+        curr->size = size;
+        curr->is_free = false;
+        curr->is_region = false;
+        curr->in_fast_bin = false;
+        curr->is_sampled = false;
+        curr->handle = nullptr;
+        curr->is_purged = false;
+        curr->next_free = nullptr;
+        curr->prev_free = nullptr;
+        out[i] = curr->address;
+    }
+    curr->next = after;
+    if (after != nullptr) {
+        after->prev = curr;
+    } else {
+        list_block_tail = curr;
+    }
+    // the last block takes whatever is left and gives it back in one split
+    curr->size = total_size - (n - 1) * (size + _size_meta_data());
+    split_block(size, curr);
+}
+
+static void sfree_batch_unlocked(void** ptrs, size_t n) {
+    if (ptrs == NULL) {
+        return;
+    }
+    sort(ptrs, ptrs + n, less<void*>());
+    size_t i = 0;
+    while (i < n) {
+        if (ptrs[i] == NULL) {
+            i++;
+            continue;
+        }
+        Span* span = page_map_get(page_of(ptrs[i]));
+        if (span == nullptr or span->kind != SPAN_HEAP) { // page heap, mmap or foreign
+            sfree_unlocked(ptrs[i++]);
+            continue;
+        }
+        MallocMetadata* block = (MallocMetadata*)ptrs[i];
+        block--;
+        i++;
+        if (block->is_region or block->is_free) {
+            continue;
+        }
+        if (block->is_sampled) {
+            sample_remove(block->address);
+        }
+        block->is_free = true;
+        block = merge_free(block);
+        // swallow the following blocks of the batch while they are neighbours
+        while (block->next != nullptr and adjacent(block, block->next)) {
+            MallocMetadata* next = block->next;
+            if (not next->is_free) {
+                if (i == n or ptrs[i] != next->address) {
+                    break;
+                }
+                if (next->is_sampled) {
+                    sample_remove(next->address);
+                }
+                next->is_free = true;
+                i++;
+            }
+            if (not merge(block, next)) {
+                break;
+            }
+        }
+        bin_insert(block);
+    }
+}
+
+static size_t smalloc_batch_unlocked(size_t size, size_t n, void** out) {
+    size_t size_aligned = aligned_size(size);
+    if (out == NULL or n == 0 or size_aligned == 0 or n > MAX_SIZE / size_aligned) {
+        return 0;
+    }
+    if (size_aligned >= PAGE_HEAP_MIN_SIZE) { // a span or mapping each, just as smalloc hands them out
+        for (size_t i = 0; i < n; i++) {
+            if (size_aligned >= MMAP_MIN_SIZE) {
+                out[i] = mmap_create(size_aligned);
+            } else {
+                Span* span = page_heap_alloc(pages_for(size_aligned));
+                out[i] = span != nullptr ? span_start(span) : NULL;
+            }
+            if (out[i] == NULL) {
+                sfree_batch_unlocked(out, i);
+                return 0;
+            }
+        }
+        return n;
+    }
+    size_t total_size = n * (size_aligned + _size_meta_data()) - _size_meta_data();
+    if (fast_bin_bytes > 0) {
+        consolidate_fast_bins();
+    }
+    MallocMetadata* block = nullptr;
+    for (size_t index = bin_index(total_size); index < BIN_MAX_SIZE and block == nullptr; index++) {
+        for (MallocMetadata* curr = free_bins[index]; curr != nullptr; curr = curr->next_free) {
+            if (curr->size >= total_size) {
+                block = curr;
+                break;
+            }
+        }
+    }
+    if (block != nullptr) {
+        bin_remove(block);
+    } else if (is_mergeable(list_block_tail) and tail_sbrk(total_size - list_block_tail->size)) {
+        bin_remove(list_block_tail);
+        list_block_tail->size = total_size;
+        block = list_block_tail;
+    } else {
+        void* address = sbrk_create(total_size);
+        if (address == NULL) {
+            return 0;
+        }
+        block = (MallocMetadata*)address - 1;
+    }
+    carve_blocks(block, size_aligned, n, out);
+    return n;
+}
+
+// counts the blocks here rather than in push_remote_free, which runs without the lock
+static void drain_remote_frees() {
+    void* block = remote_frees.exchange(nullptr, memory_order_acquire);
+    while (block) {
+        void* next = *(void**)block;
+        sfree_unlocked(block);
+        TELEMETRY_ADD(remote_frees, 1);
+        block = next;
+    }
+}
+
+static void* smalloc_heap(size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    PATH_TIMER_START();
+    void* address = smalloc_unlocked(size);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(smalloc_calls, 1);
+    bool sample = address != NULL and should_sample(size);
+    pthread_mutex_unlock(&heap_lock);
+    PROBE2(smalloc, size, address);
+    if (sample) {
+        record_sample(address, size);
+    }
+    return address;
+}
+
+/* Per-CPU caches (scpu_cache_start): while they run, smalloc, sfree and
+ * sfree_sized serve blocks up to SCPU_MAX_SIZE from a cache owned by the CPU
+ * they run on, so the cached memory grows with the number of CPUs rather than
+ * threads. Each size class of a CPU is a stack of SCPU_SLOTS blocks. A pop or a
+ * push is one rseq critical section that commits with a single store: a thread
+ * preempted, migrated or signalled inside it restarts it, so two threads never
+ * interleave on one stack and no atomics or locks are needed. A miss refills
+ * the class with smalloc_batch and a full class hands half of itself back with
+ * sfree_batch. scpu_cache_stop zeroes every capacity, fences with membarrier
+ * so that no critical section still in flight can commit, and drains the
+ * stacks. Without rseq (or that membarrier), the caches fall back to the
+ * per-thread lists of malloc_4_inline.h. Cache hits skip the heap profile and
+ * the telemetry call counters. */
+
+#define SCPU_MAX_SIZE 256
+#define SCPU_CLASSES (SCPU_MAX_SIZE / 16)
+#define SCPU_SLOTS 32
+#define SCPU_REFILL (SCPU_SLOTS / 2)
+
+enum CpuCacheMode { CPU_CACHE_OFF, CPU_CACHE_RSEQ, CPU_CACHE_THREAD };
+
+static int cpu_cache_mode = CPU_CACHE_OFF;
+static pthread_mutex_t cpu_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef MALLOC_RSEQ
+struct CpuClass {
+    uint64_t count;
+    uint64_t capacity; // 0 while the caches are stopped
+    void* slots[SCPU_SLOTS];
+};
+
+struct alignas(64) CpuCache {
+    CpuClass classes[SCPU_CLASSES + 1]; // by size / 16, entry 0 unused
+};
+
+static_assert(offsetof(CpuClass, count) == 0 and offsetof(CpuClass, capacity) == 8 and
+              offsetof(CpuClass, slots) == 16, "the critical sections below hard-code this layout");
+
+// mapped by the first start and kept, a thread may still hold the pointer after a stop
+static CpuCache* cpu_caches = nullptr;
+static uint32_t cpu_count = 0;
+
+/* The pieces of a critical section: its struct rseq_cs descriptor (start 1f,
+ * commit 2f, abort 4f), storing it in the thread's struct rseq and the abort
+ * handler, which the kernel wants right behind RSEQ_SIG. Both sections read the
+ * CPU number from struct rseq and turn it into the class stack in %rax. */
+#define RSEQ_ENTER \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0, 0\n\t" \
+    ".quad 1f, 2f - 1f, 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %%fs:8(%[rseq])\n\t" \
+    "1:\n\t" \
+    "movl %%fs:4(%[rseq]), %%eax\n\t" \
+    "cmpl %[cpus], %%eax\n\t" \
+    "jae %l[miss]\n\t" \
+    "imulq %[stride], %%rax, %%rax\n\t" \
+    "addq %[classes], %%rax\n\t"
+
+#define RSEQ_EXIT \
+    "2:\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[abort]\n\t" \
+    ".popsection\n\t"
+
+static_assert(RSEQ_SIG == 0x53053053, "RSEQ_EXIT hard-codes the signature");
+
+static void* cpu_cache_pop(size_t index) {
+    void* block;
+retry:
+    __asm__ goto(
+        RSEQ_ENTER
+        "cmpq $0, 8(%%rax)\n\t"             // capacity
+        "je %l[miss]\n\t"
+        "movq (%%rax), %%rcx\n\t"           // count
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[miss]\n\t"
+        "movq 8(%%rax,%%rcx,8), %%rdx\n\t"  // slots[count - 1]
+        "movq %%rdx, (%[block])\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"           // commit
+        RSEQ_EXIT
+        :
+        : [rseq] "r" (__rseq_offset), [cpus] "r" (cpu_count), [stride] "i" (sizeof(CpuCache)),
+          [classes] "r" (&cpu_caches->classes[index]), [block] "r" (&block)
+        : "memory", "cc", "rax", "rcx", "rdx"
+        : miss, abort);
+    return block;
+abort:
+    goto retry;
+miss:
+    return nullptr;
+}
+
+static bool cpu_cache_push(size_t index, void* p) {
+retry:
+    __asm__ goto(
+        RSEQ_ENTER
+        "movq (%%rax), %%rcx\n\t"           // count
+        "cmpq 8(%%rax), %%rcx\n\t"          // capacity
+        "jae %l[miss]\n\t"
+        "movq %[p], 16(%%rax,%%rcx,8)\n\t"  // slots[count]
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"           // commit
+        RSEQ_EXIT
+        :
+        : [rseq] "r" (__rseq_offset), [cpus] "r" (cpu_count), [stride] "i" (sizeof(CpuCache)),
+          [classes] "r" (&cpu_caches->classes[index]), [p] "r" (p)
+        : "memory", "cc", "rax", "rcx"
+        : miss, abort);
+    return true;
+abort:
+    goto retry;
+miss:
+    return false;
+}
+
+static void* cpu_cache_alloc(size_t size) {
+    size_t index = (size + 15) / 16;
+    void* block = cpu_cache_pop(index);
+    if (block != nullptr) {
+        return block;
+    }
+    void* blocks[SCPU_REFILL];
+    if (smalloc_batch(index * 16, SCPU_REFILL, blocks) == 0) {
+        return nullptr;
+    }
+    // pushed back to front, so the pops hand them out in address order
+    size_t left = SCPU_REFILL - 1;
+    while (left > 0 and cpu_cache_push(index, blocks[left])) {
+        left--;
+    }
+    if (left > 0) { // moved to a full CPU, or the caches stopped
+        sfree_batch(blocks + 1, left);
+    }
+    return blocks[0];
+}
+
+static bool cpu_cache_free(void* p, size_t index) {
+    if (cpu_cache_push(index, p)) {
+        return true;
+    }
+    void* blocks[SCPU_REFILL];
+    size_t n = 0;
+    while (n < SCPU_REFILL and (blocks[n] = cpu_cache_pop(index)) != nullptr) {
+        n++;
+    }
+    if (n > 0) {
+        sfree_batch(blocks, n);
+    }
+    return cpu_cache_push(index, p);
+}
+
+static bool cpu_caches_init() {
+    if (__rseq_size == 0) { // glibc did not register the threads
+        return false;
+    }
+    if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) != 0) {
+        return false;
+    }
+    if (cpu_caches == nullptr) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        if (cpus <= 0) {
+            return false;
+        }
+        void* caches = mmap(NULL, cpus * sizeof(CpuCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (caches == MAP_FAILED) {
+            return false;
+        }
+        cpu_caches = (CpuCache*)caches;
+        cpu_count = cpus;
+    }
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        for (size_t index = 1; index <= SCPU_CLASSES; index++) {
+            __atomic_store_n(&cpu_caches[cpu].classes[index].capacity, SCPU_SLOTS, __ATOMIC_RELAXED);
+        }
+    }
+    return true;
+}
+
+static void cpu_caches_drain() {
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        for (size_t index = 1; index <= SCPU_CLASSES; index++) {
+            __atomic_store_n(&cpu_caches[cpu].classes[index].capacity, 0, __ATOMIC_RELAXED);
+        }
+    }
+    // restarts every critical section in flight, which then sees no capacity: the stacks are ours
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        void* blocks[SCPU_CLASSES * SCPU_SLOTS];
+        size_t n = 0;
+        for (size_t index = 1; index <= SCPU_CLASSES; index++) {
+            CpuClass* cpu_class = &cpu_caches[cpu].classes[index];
+            for (size_t slot = 0; slot < cpu_class->count; slot++) {
+                blocks[n++] = cpu_class->slots[slot];
+            }
+            cpu_class->count = 0;
+        }
+        if (n > 0) {
+            sfree_batch(blocks, n);
+        }
+    }
+}
+#endif
+
+// a block for size from the caches, NULL when the heap has to serve it
+static void* cpu_cache_get(size_t size) {
+    int mode = __atomic_load_n(&cpu_cache_mode, __ATOMIC_RELAXED);
+    if (mode == CPU_CACHE_OFF or size == 0 or size > SCPU_MAX_SIZE) {
+        return NULL;
+    }
+#ifdef MALLOC_RSEQ
+    if (mode == CPU_CACHE_RSEQ) {
+        return cpu_cache_alloc(size);
+    }
+#endif
+    return smalloc_inline(size);
+}
+
+// true when the caches took the heap block
+static bool cpu_cache_put(MallocMetadata* block) {
+    int mode = __atomic_load_n(&cpu_cache_mode, __ATOMIC_RELAXED);
+    if (mode == CPU_CACHE_OFF or block->size < 16 or block->size > SCPU_MAX_SIZE or block->is_sampled) {
+        return false;
+    }
+#ifdef MALLOC_RSEQ
+    if (mode == CPU_CACHE_RSEQ) {
+        return cpu_cache_free(block->address, block->size / 16);
+    }
+#endif
+    sfree_inline(block->address, block->size / 16 * 16);
+    return true;
+}
+
+bool scpu_cache_start() {
+    pthread_mutex_lock(&cpu_cache_lock);
+    if (cpu_cache_mode != CPU_CACHE_OFF) {
+        pthread_mutex_unlock(&cpu_cache_lock);
+        return false;
+    }
+    int mode = CPU_CACHE_THREAD;
+#ifdef MALLOC_RSEQ
+    if (cpu_caches_init()) {
+        mode = CPU_CACHE_RSEQ;
+    }
+#endif
+    __atomic_store_n(&cpu_cache_mode, mode, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cpu_cache_lock);
+    return true;
+}
+
+void scpu_cache_stop() {
+    pthread_mutex_lock(&cpu_cache_lock);
+    int mode = cpu_cache_mode;
+    __atomic_store_n(&cpu_cache_mode, CPU_CACHE_OFF, __ATOMIC_RELAXED);
+#ifdef MALLOC_RSEQ
+    if (mode == CPU_CACHE_RSEQ) {
+        cpu_caches_drain();
+    }
+#endif
+    if (mode == CPU_CACHE_THREAD) { // the other threads keep their lists until they exit
+        sinline_flush();
+    }
+    pthread_mutex_unlock(&cpu_cache_lock);
+}
+
+bool scpu_cache_per_cpu() {
+    return __atomic_load_n(&cpu_cache_mode, __ATOMIC_RELAXED) == CPU_CACHE_RSEQ;
+}
+
+void* smalloc(size_t size) {
+    void* cached = cpu_cache_get(size);
+    if (cached != NULL) {
+        return cached;
+    }
+    return smalloc_heap(size);
+}
+
+void* smemalign(size_t alignment, size_t size) {
+    if (alignment == 0 or (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    PATH_TIMER_START();
+    void* address = smemalign_unlocked(alignment, size);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(smalloc_calls, 1);
+    bool sample = address != NULL and should_sample(size);
+    pthread_mutex_unlock(&heap_lock);
+    PROBE3(smemalign, alignment, size, address);
+    if (sample) {
+        record_sample(address, size);
+    }
+    return address;
+}
+
+static void push_remote_free(void* p) {
+    void* head = remote_frees.load(memory_order_relaxed);
+    do {
+        *(void**)p = head;
+    } while (not remote_frees.compare_exchange_weak(head, p, memory_order_release, memory_order_relaxed));
+    PROBE1(sfree_remote, p);
+#ifdef MALLOC_PATH_STATS
+    __atomic_fetch_add(&path_hits[PATH_SFREE_REMOTE], 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void sfree(void* p) {
+    if (p == NULL){
+        return;
+    }
+    // the entries for pages the caller still owns do not change under it
+    Span* span = page_map_get(page_of(p));
+    if (span == nullptr) { // not from this heap
+        return;
+    }
+    if (not is_page_object(span, p)) {
+        MallocMetadata* block = (MallocMetadata*)p - 1;
+        if (block->is_region or cpu_cache_put(block)) { // a region releases its blocks together
+            return;
+        }
+    }
+    if (pthread_mutex_trylock(&heap_lock) != 0) { // heap busy, hand the block to the lock holder
+        push_remote_free(p);
+        return;
+    }
+    drain_remote_frees();
+    PATH_TIMER_START();
+    sfree_unlocked(p);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(sfree_calls, 1);
+    pthread_mutex_unlock(&heap_lock);
+    PROBE1(sfree, p);
+}
+
+void sfree_sized(void* p, size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (p == NULL or size_aligned == 0 or size_aligned >= PAGE_HEAP_MIN_SIZE) {
+        sfree(p);
+        return;
+    }
+    // smaller blocks always sit on the sbrk heap behind a header, no page map walk needed
+    MallocMetadata* block = (MallocMetadata*)p - 1;
+    if (block->is_region or cpu_cache_put(block)) {
+        return;
+    }
+    if (pthread_mutex_trylock(&heap_lock) != 0) {
+        push_remote_free(p);
+        return;
+    }
+    drain_remote_frees();
+    PATH_TIMER_START();
+    sfree_heap_block(block);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(sfree_calls, 1);
+    pthread_mutex_unlock(&heap_lock);
+    PROBE1(sfree, p);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    PATH_TIMER_START();
+    void* address = srealloc_unlocked(oldp, size);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(srealloc_calls, 1);
+    bool sample = address != NULL and should_sample(size);
+    pthread_mutex_unlock(&heap_lock);
+    PROBE3(srealloc, oldp, size, address);
+    if (sample) {
+        record_sample(address, size);
+    }
+    return address;
+}
+
+size_t smalloc_batch(size_t size, size_t n, void** out) {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    PATH_TIMER_START();
+    size_t allocated = smalloc_batch_unlocked(size, n, out);
+    PATH_TAKEN(allocated != 0 ? PATH_BATCH_ALLOC : PATH_FAILED);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(smalloc_calls, allocated);
+    pthread_mutex_unlock(&heap_lock);
+    return allocated;
+}
+
+void sfree_batch(void** ptrs, size_t n) {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    PATH_TIMER_START();
+    sfree_batch_unlocked(ptrs, n);
+    PATH_TAKEN(PATH_BATCH_FREE);
+    PATH_TIMER_STOP();
+    TELEMETRY_ADD(sfree_calls, n);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Slow path of the inline thread cache (malloc_4_inline.h). Lists are refilled
+ * and drained SINLINE_REFILL blocks at a time, so the lock is taken once per
+ * that many fast path hits. A thread's first slow call arms a key whose
+ * destructor flushes the thread's lists when it exits. */
+
+#define SINLINE_REFILL (SINLINE_MAX_COUNT / 2)
+
+__thread SInlineCache sinline_cache;
+
+static __thread bool sinline_armed = false;
+static pthread_key_t sinline_key;
+static pthread_once_t sinline_key_once = PTHREAD_ONCE_INIT;
+
+static void sinline_thread_exit(void*) {
+    sinline_flush();
+    sinline_armed = false;
+    for (size_t index = 1; index <= SINLINE_CLASSES; index++) {
+        sinline_cache.room[index] = 0;
+    }
+}
+
+static void sinline_create_key() {
+    pthread_key_create(&sinline_key, sinline_thread_exit);
+}
+
+static void sinline_arm() {
+    if (sinline_armed) {
+        return;
+    }
+    pthread_once(&sinline_key_once, sinline_create_key);
+    pthread_setspecific(sinline_key, &sinline_cache);
+    sinline_armed = true;
+    for (size_t index = 1; index <= SINLINE_CLASSES; index++) {
+        sinline_cache.room[index] = SINLINE_MAX_COUNT;
+    }
+}
+
+static void sinline_push(size_t index, void* p) {
+    *(void**)p = sinline_cache.heads[index];
+    sinline_cache.heads[index] = p;
+    sinline_cache.room[index]--;
+}
+
+static size_t sinline_pop_all(size_t index, void** out, size_t n) {
+    size_t popped = 0;
+    while (popped < n and sinline_cache.heads[index] != nullptr) {
+        out[popped] = sinline_cache.heads[index];
+        sinline_cache.heads[index] = *(void**)out[popped++];
+        sinline_cache.room[index]++;
+    }
+    return popped;
+}
+
+void* sinline_alloc_slow(size_t size) {
+    size_t index = (size + 15) / 16;
+    if (index == 0 or index > SINLINE_CLASSES) {
+        return smalloc(size);
+    }
+    sinline_arm();
+    void* blocks[SINLINE_REFILL];
+    if (smalloc_batch(index * 16, SINLINE_REFILL, blocks) == 0) {
+        return smalloc_heap(size);
+    }
+    // pushed back to front, so the fast path hands them out in address order
+    for (size_t i = SINLINE_REFILL - 1; i > 0; i--) {
+        sinline_push(index, blocks[i]);
+    }
+    return blocks[0];
+}
+
+void sinline_free_slow(void* p, size_t size) {
+    size_t index = (size + 15) / 16;
+    if (p == NULL) {
+        return;
+    }
+    if (index == 0 or index > SINLINE_CLASSES) {
+        sfree_sized(p, size);
+        return;
+    }
+    sinline_arm();
+    if (sinline_cache.room[index] == 0) {
+        void* blocks[SINLINE_REFILL];
+        sfree_batch(blocks, sinline_pop_all(index, blocks, SINLINE_REFILL));
+    }
+    sinline_push(index, p);
+}
+
+void sinline_flush() {
+    void* blocks[SINLINE_CLASSES * SINLINE_MAX_COUNT];
+    size_t n = 0;
+    for (size_t index = 1; index <= SINLINE_CLASSES; index++) {
+        n += sinline_pop_all(index, blocks + n, SINLINE_MAX_COUNT);
+    }
+    if (n > 0) {
+        sfree_batch(blocks, n);
+    }
+}
+
+/* Decay: an optional background thread that returns free memory gradually, in
+ * the manner of jemalloc's decay. Every decay_ms / DECAY_STEPS it measures the
+ * dirty bytes (free memory still backed by pages), remembers how much of it is
+ * new, and purges down to the sum over the last DECAY_STEPS epochs of each
+ * epoch's new bytes weighted by 1 - smoothstep(age / DECAY_STEPS). Memory that
+ * stays free is thus gone after decay_ms, while memory freed and reused in
+ * quick succession never costs a syscall. The wilderness is purged first with a
+ * negative sbrk, then whole free page heap runs with munmap, then the pages
+ * inside large free heap blocks with madvise. The thread waits on heap_lock
+ * itself, so everything it touches is serialized with the allocator. */
+
+#define DECAY_DEFAULT_MS 10000
+#define DECAY_STEPS 100
+
+static pthread_t decay_thread;
+static pthread_cond_t decay_cond = PTHREAD_COND_INITIALIZER;
+static size_t decay_epoch_ms = DECAY_DEFAULT_MS / DECAY_STEPS;
+static size_t decay_history[DECAY_STEPS];
+static double decay_weights[DECAY_STEPS];
+static size_t decay_last_dirty = 0;
+static size_t decay_purged = 0;
+
+static char* page_floor(char* address) {
+    return (char*)((uintptr_t)address & ~(PAGE_BYTES - 1));
+}
+
+static char* page_ceil(char* address) {
+    return page_floor(address + PAGE_BYTES - 1);
+}
+
+// the whole pages inside a free heap block, its header and links stay
+static size_t purgeable_bytes(MallocMetadata* block) {
+    char* first = page_ceil((char*)block->address);
+    char* last = page_floor((char*)block->address + block->size);
+    return last > first ? last - first : 0;
+}
+
+// the tail of the heap a negative sbrk could hand back, keeping MIN_SPLIT bytes of the block
+static size_t wilderness_bytes() {
+    if (not is_mergeable(list_block_tail) or raw_sbrk(0) != (char*)list_block_tail->address + list_block_tail->size) {
+        return 0;
+    }
+    char* keep = page_ceil((char*)list_block_tail->address + MIN_SPLIT);
+    char* end = (char*)list_block_tail->address + list_block_tail->size;
+    return end > keep ? end - keep : 0;
+}
+
+static size_t decay_dirty_bytes() {
+    size_t dirty = wilderness_bytes() + page_heap_free_pages * PAGE_BYTES;
+    for (size_t index = 0; index < BIN_MAX_SIZE; index++) {
+        for (MallocMetadata* block = free_bins[index]; block != nullptr; block = block->next_free) {
+            if (not block->is_purged and block != list_block_tail) {
+                dirty += purgeable_bytes(block);
+            }
+        }
+    }
+    return dirty;
+}
+
+// hands the wilderness back with a negative sbrk, returns the bytes it did
+static size_t trim_wilderness() {
+    size_t trimmed = wilderness_bytes();
+    if (trimmed > 0) {
+        MallocMetadata* tail = list_block_tail;
+        bin_remove(tail);
+        heap_sbrk(-(intptr_t)trimmed);
+        tail->size -= trimmed;
+        bin_insert(tail);
+    }
+    return trimmed;
+}
+
+static size_t decay_purge(size_t target) {
+    size_t purged = trim_wilderness();
+    for (size_t index = PAGE_HEAP_LISTS - 1; index > 0 and purged < target; index--) {
+        while (page_heap_free_lists[index] != nullptr and purged < target) {
+            Span* span = page_heap_free_lists[index];
+            page_list_remove(span);
+            page_spans_unlink(span);
+            purged += span->num_pages * PAGE_BYTES;
+            munmap(span_start(span), span->num_pages * PAGE_BYTES);
+            TELEMETRY_ADD(munmap_calls, 1);
+            TELEMETRY_SUB(page_bytes, span->num_pages * PAGE_BYTES);
+            span_destroy(span);
+        }
+    }
+    for (size_t index = BIN_MAX_SIZE; index > 0 and purged < target; index--) {
+        for (MallocMetadata* block = free_bins[index - 1]; block != nullptr and purged < target; block = block->next_free) {
+            size_t bytes = purgeable_bytes(block);
+            if (block->is_purged or bytes == 0) {
+                continue;
+            }
+            madvise(page_ceil((char*)block->address), bytes, MADV_DONTNEED);
+            TELEMETRY_ADD(madvise_calls, 1);
+            block->is_purged = true;
+            purged += bytes;
+        }
+    }
+    decay_purged += purged;
+    return purged;
+}
+
+static void decay_epoch() {
+    size_t dirty = decay_dirty_bytes();
+    memmove(decay_history + 1, decay_history, (DECAY_STEPS - 1) * sizeof(size_t));
+    decay_history[0] = dirty > decay_last_dirty ? dirty - decay_last_dirty : 0;
+    double limit = 0;
+    for (size_t age = 0; age < DECAY_STEPS; age++) {
+        limit += decay_history[age] * decay_weights[age];
+    }
+    if (dirty > limit) {
+        decay_purge(dirty - (size_t)limit);
+        dirty = decay_dirty_bytes();
+    }
+    decay_last_dirty = dirty;
+}
+
+static void* decay_main(void*) {
+    pthread_mutex_lock(&heap_lock);
+    while (decay_running) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += (long)(decay_epoch_ms % 1000) * 1000000;
+        wake.tv_sec += decay_epoch_ms / 1000 + wake.tv_nsec / 1000000000;
+        wake.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&decay_cond, &heap_lock, &wake);
+        if (decay_running) {
+            drain_remote_frees();
+            decay_epoch();
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return nullptr;
+}
+
+bool sdecay_start(size_t decay_ms) {
+    if (decay_ms == 0) {
+        decay_ms = DECAY_DEFAULT_MS;
+    }
+    pthread_mutex_lock(&heap_lock);
+    if (decay_running) {
+        pthread_mutex_unlock(&heap_lock);
+        return false;
+    }
+    decay_epoch_ms = decay_ms / DECAY_STEPS > 0 ? decay_ms / DECAY_STEPS : 1;
+    for (size_t age = 0; age < DECAY_STEPS; age++) {
+        double x = double(age + 1) / DECAY_STEPS;
+        decay_weights[age] = 1 - x * x * (3 - 2 * x);
+        decay_history[age] = 0;
+    }
+    decay_last_dirty = decay_dirty_bytes();
+    decay_running = true;
+    if (pthread_create(&decay_thread, NULL, decay_main, NULL) != 0) {
+        decay_running = false;
+    }
+    bool started = decay_running;
+    pthread_mutex_unlock(&heap_lock);
+    return started;
+}
 
-size_t _num_allocated_blocks();
+void sdecay_stop() {
+    pthread_mutex_lock(&heap_lock);
+    if (not decay_running) {
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    decay_running = false;
+    pthread_cond_signal(&decay_cond);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_join(decay_thread, NULL);
+}
 
-size_t _num_allocated_bytes();
+size_t sdecay_purged_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    size_t purged = decay_purged;
+    pthread_mutex_unlock(&heap_lock);
+    return purged;
+}
 
-size_t _num_meta_data_bytes();
+/* Handles: blocks the allocator may move. A handle is an entry in a slab of
+ * SHandleEntry that holds the block's address and a pin count; the block's
+ * header points back at it. scompact walks the sbrk heap once and, whenever a
+ * free block is followed by an unpinned handle block, moves the handle block
+ * down to the free block's start (header included) and puts the free space
+ * behind it, where it merges with whatever free block follows. Free space thus
+ * bubbles up past every handle block until a pinned or ordinary block stops it,
+ * and the free tail it gathers in goes back to the OS with trim_wilderness.
+ * Pinning takes heap_lock, so a block never moves while its pin is being
+ * taken. Handle blocks of a page heap run or an mmap never move. */
 
-size_t _size_meta_data();
+#define HANDLE_SLAB_SIZE (64 * KB)
 
-static size_t aligned_size(size_t old_size){
-    return ceil(float(old_size)/float(8))*8;
+struct SHandleEntry {
+    void* address;
+    size_t pins;
+    SHandleEntry* next_free;
+};
+
+static SHandleEntry* free_handles = nullptr;
+
+static SHandleEntry* handle_create() {
+    if (free_handles == nullptr) {
+        void* slab = mmap(NULL, HANDLE_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        TELEMETRY_ADD(mmap_calls, 1);
+        if (slab == (void*)(-1)) {
+            return nullptr;
+        }
+        for (SHandleEntry* entry = (SHandleEntry*)slab; entry + 1 <= (SHandleEntry*)((char*)slab + HANDLE_SLAB_SIZE); ++entry) {
+            entry->next_free = free_handles;
+            free_handles = entry;
+        }
+    }
+    SHandleEntry* entry = free_handles;
+    free_handles = entry->next_free;
+    entry->next_free = nullptr;
+    entry->pins = 0;
+    return entry;
 }
 
-static void split_block(size_t size, MallocMetadata* block_to_split) {
-    if (block_to_split->size < MIN_SPLIT + size + _size_meta_data()) {
-        return;
+static void handle_destroy(SHandleEntry* entry) {
+    entry->address = nullptr;
+    entry->next_free = free_handles;
+    free_handles = entry;
+}
+
+// the header of a handle block on the sbrk heap, nullptr for a page heap run or an mmap
+static MallocMetadata* heap_block_of(void* address) {
+    Span* span = page_map_get(page_of(address));
+    if (span == nullptr or span->kind != SPAN_HEAP) {
+        return nullptr;
     }
-    size_t size_left = block_to_split->size - size - _size_meta_data();
-    block_to_split->size = size;
-    void * temp = static_cast<char*>(block_to_split->address) + size;
-    MallocMetadata * new_metadata = static_cast<MallocMetadata*>(temp);
-    new_metadata->address = static_cast<char*>(temp) + _size_meta_data();
-    new_metadata->size = size_left;
-    MallocMetadata * tmp =  block_to_split->next;
-    new_metadata->next = tmp;
-    new_metadata->prev = block_to_split;
-    if (block_to_split->next != nullptr) {
-        block_to_split->next->prev = new_metadata;
+    return (MallocMetadata*)address - 1;
+}
+
+static bool is_movable(MallocMetadata* block) {
+    return block->handle != nullptr and block->handle->pins == 0;
+}
+
+/* Moves the handle block behind free_block down to free_block's place and
+ * returns the free block that is left behind it. */
+static MallocMetadata* slide_down(MallocMetadata* free_block) {
+    MallocMetadata* moving = free_block->next;
+    MallocMetadata* prev = free_block->prev;
+    MallocMetadata* after = moving->next;
+    size_t gap = free_block->size;
+    bool moving_is_tail = list_block_tail == moving;
+    bin_remove(free_block);
+    PROBE3(slide_down, moving->address, free_block->address, moving->size);
+    memmove(free_block, moving, _size_meta_data() + moving->size);
+    MallocMetadata* moved = free_block;
+    moved->address = moved + 1;
+    moved->prev = prev;
+    moved->handle->address = moved->address;
+    MallocMetadata* left = (MallocMetadata*)((char*)moved->address + moved->size);
+    left->size = gap;
+    left->is_free = true;
+    left->is_region = false;
+    left->in_fast_bin = false;
+    left->is_sampled = false;
+    left->is_purged = false;
+    left->handle = nullptr;
+    left->address = left + 1;
+    left->next_free = nullptr;
+    left->prev_free = nullptr;
+    left->prev = moved;
+    left->next = after;
+    moved->next = left;
+    if (after != nullptr) {
+        after->prev = left;
     }
-    block_to_split->next = new_metadata;
-    if (block_to_split == list_block_tail) {
-        list_block_tail = new_metadata;
+    if (moving_is_tail) {
+        list_block_tail = left;
     }
-    new_metadata->is_free = true;
-    if (new_metadata->size >= MMAP_MIN_SIZE) {
-        if (new_metadata == mmap_list_block_tail) {
-            mmap_list_block_tail = new_metadata->prev;
-        }
-        if (new_metadata == mmap_list_block_head) {
-            mmap_list_block_head = new_metadata->next;
-        }
-        if (new_metadata->next != nullptr) {
-            new_metadata->next->prev = new_metadata->prev;
-        }
-        if (new_metadata->prev != nullptr) {
-            new_metadata->prev->next = new_metadata->next;
+    merge(left, after);
+    bin_insert(left);
+    return left;
+}
+
+SHandle shandle_alloc(size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    SHandleEntry* entry = handle_create();
+    void* address = entry != nullptr ? smalloc_unlocked(size) : NULL;
+    if (address == NULL) {
+        if (entry != nullptr) {
+            handle_destroy(entry);
         }
-        munmap((void*)new_metadata, new_metadata->size + _size_meta_data());
+        pthread_mutex_unlock(&heap_lock);
+        return nullptr;
+    }
+    entry->address = address;
+    MallocMetadata* block = heap_block_of(address);
+    if (block != nullptr) {
+        block->handle = entry;
+    }
+    TELEMETRY_ADD(smalloc_calls, 1);
+    pthread_mutex_unlock(&heap_lock);
+    return entry;
+}
+
+void shandle_free(SHandle handle) {
+    if (handle == nullptr) {
         return;
     }
-    size_t index = new_metadata->size / KB;
-    MallocMetadata* first_in_bin = free_bins[index];
-    if (first_in_bin) {
-        first_in_bin->prev_free = new_metadata;
-        new_metadata->next_free = first_in_bin;
-        new_metadata->prev_free = nullptr;
-        free_bins[index] = new_metadata;
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    MallocMetadata* block = heap_block_of(handle->address);
+    if (block != nullptr) {
+        block->handle = nullptr;
     }
-    free_bins[index] = new_metadata;
+    sfree_unlocked(handle->address);
+    handle_destroy(handle);
+    TELEMETRY_ADD(sfree_calls, 1);
+    pthread_mutex_unlock(&heap_lock);
 }
 
-static bool merge(MallocMetadata* first , MallocMetadata* second){
-    if (first == nullptr or second == nullptr) {
-        return false;
+void* shandle_pin(SHandle handle) {
+    if (handle == nullptr) {
+        return NULL;
     }
-    if (not first->is_free or not second->is_free) {
-        return false;
+    pthread_mutex_lock(&heap_lock);
+    handle->pins++;
+    void* address = handle->address;
+    pthread_mutex_unlock(&heap_lock);
+    return address;
+}
+
+void shandle_unpin(SHandle handle) {
+    if (handle == nullptr) {
+        return;
     }
-    first->size += second->size + _size_meta_data();
-    first->next = second->next;
-    if (second->next != nullptr) {
-        second->next->prev = first;
+    pthread_mutex_lock(&heap_lock);
+    if (handle->pins > 0) {
+        handle->pins--;
     }
-    if (first->prev_free != nullptr) {
-        first->prev_free->next_free = first->next_free;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+size_t scompact() {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    if (fast_bin_bytes > 0) {
+        consolidate_fast_bins();
     }
-    if (first->next_free != nullptr) {
-        first->next_free->prev_free = first->prev_free;
+    size_t moved = 0;
+    for (MallocMetadata* block = list_block_head; block != nullptr; block = block->next) {
+        while (is_mergeable(block) and block->next != nullptr and adjacent(block, block->next) and
+               is_movable(block->next)) {
+            moved += block->next->size;
+            block = slide_down(block);
+        }
     }
-    if (second->prev_free != nullptr) {
-        second->prev_free->next_free = second->next_free;
+    size_t trimmed = trim_wilderness();
+    pthread_mutex_unlock(&heap_lock);
+    PROBE2(compact, moved, trimmed);
+    return trimmed;
+}
+
+/* Telemetry page: stelemetry_start copies the counters into a shared memory
+ * object named after the pid and points the allocator at it; stelemetry_stop
+ * takes them back and removes the object. A forked child keeps the counters as
+ * a private copy instead of writing into its parent's page. */
+
+static bool telemetry_fork_handler = false;
+
+static void telemetry_detach() {
+    if (telemetry == &local_telemetry) {
+        return;
     }
-    if (second->next_free != nullptr) {
-        second->next_free->prev_free = second->prev_free;
+    STelemetry* page = telemetry;
+    memcpy(&local_telemetry, page, sizeof(STelemetry));
+    telemetry = &local_telemetry;
+    munmap(page, sizeof(STelemetry));
+}
+
+bool stelemetry_start() {
+    char name[32];
+    stelemetry_name(name, sizeof(name), getpid());
+    pthread_mutex_lock(&heap_lock);
+    if (telemetry != &local_telemetry) {
+        pthread_mutex_unlock(&heap_lock);
+        return false;
     }
-    if (list_block_tail == second) {
-        list_block_tail = first;
+    // a page left behind by a dead process with the same pid is taken over
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&heap_lock);
+        return false;
+    }
+    void* page = MAP_FAILED;
+    if (ftruncate(fd, sizeof(STelemetry)) == 0) {
+        page = mmap(NULL, sizeof(STelemetry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (page == MAP_FAILED) {
+        shm_unlink(name);
+        pthread_mutex_unlock(&heap_lock);
+        return false;
     }
+    local_telemetry.version = STELEMETRY_VERSION;
+    local_telemetry.pid = getpid();
+    local_telemetry.meta_data_size = _size_meta_data();
+    memcpy(page, &local_telemetry, sizeof(STelemetry));
+    // readers wait for the magic, which comes last
+    __atomic_store_n(&((STelemetry*)page)->magic, STELEMETRY_MAGIC, __ATOMIC_RELEASE);
+    telemetry = (STelemetry*)page;
+    if (not telemetry_fork_handler) {
+        pthread_atfork(nullptr, nullptr, telemetry_detach);
+        telemetry_fork_handler = true;
+    }
+    pthread_mutex_unlock(&heap_lock);
     return true;
 }
 
-static MallocMetadata *merge_free (MallocMetadata* block_to_merge) {
-    merge(block_to_merge , block_to_merge->next);
-    if (merge(block_to_merge->prev, block_to_merge)) {
-        return block_to_merge->prev;
+void stelemetry_stop() {
+    char name[32];
+    stelemetry_name(name, sizeof(name), getpid());
+    pthread_mutex_lock(&heap_lock);
+    if (telemetry != &local_telemetry) {
+        telemetry_detach();
+        shm_unlink(name);
     }
-    return block_to_merge;
+    pthread_mutex_unlock(&heap_lock);
 }
 
-static void* mmap_create (size_t size) {
-    void* new_mmap = mmap(NULL, size + _size_meta_data(), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (new_mmap == (void*)(-1)) {
-        return NULL;
-    }
-    ((MallocMetadata*) new_mmap)->size = size;
-    ((MallocMetadata*) new_mmap)->is_free = false;
-    ((MallocMetadata*) new_mmap)->address = (void*)((char*)new_mmap + _size_meta_data());
-    if (mmap_list_block_head == nullptr){ //case list empty
-        mmap_list_block_head = (MallocMetadata*) new_mmap;
-        mmap_list_block_head->next = nullptr;
-        mmap_list_block_head->prev = nullptr;
-        mmap_list_block_tail = mmap_list_block_head;
-    } else { // new element added to last place
-        /*update prev and next*/
-        mmap_list_block_tail->next = (MallocMetadata*) new_mmap;
-        ((MallocMetadata*) new_mmap)->next = nullptr;
-        ((MallocMetadata*) new_mmap)->prev = mmap_list_block_tail;
-        mmap_list_block_tail = ((MallocMetadata*) new_mmap);
+#ifdef MALLOC_PATH_STATS
+void spath_stats_dump(int fd) {
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%-22s %12s %16s %12s\n", "path", "hits", "cycles", "cycles/hit");
+    write(fd, line, length);
+    pthread_mutex_lock(&heap_lock);
+    for (int path = 0; path < PATH_COUNT; path++) {
+        size_t hits = __atomic_load_n(&path_hits[path], __ATOMIC_RELAXED);
+        if (hits == 0) {
+            continue;
+        }
+        length = snprintf(line, sizeof(line), "%-22s %12zu %16llu %12llu\n", path_names[path], hits,
+                          path_cycles[path], path_cycles[path] / hits);
+        write(fd, line, length);
     }
-    return ((MallocMetadata*) new_mmap)->address;
+    pthread_mutex_unlock(&heap_lock);
 }
 
-void* smalloc(size_t size) {
-    size_t size_aligned = aligned_size(size);
-    if (size_aligned == 0 or size_aligned > pow(10,8)) {
-        return NULL;
+const char* spath_stats_last() {
+    return path_names[current_path];
+}
+#endif
+
+void sheap_profile_start(size_t sample_period) {
+    // the first backtrace loads libgcc, which mallocs through libc and moves the
+    // program break behind our wilderness block, so do it now and not mid-sample
+    void* warm_up[1];
+    backtrace(warm_up, 1);
+    pthread_mutex_lock(&heap_lock);
+    heap_profile_period = sample_period != 0 ? sample_period : HEAP_PROFILE_DEFAULT_PERIOD;
+    bytes_until_sample = next_sample_gap();
+    heap_profile_enabled = true;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void sheap_profile_stop() {
+    pthread_mutex_lock(&heap_lock);
+    heap_profile_enabled = false;
+    for (size_t slot = 0; slot < HEAP_PROFILE_SLOTS; slot++) {
+        if (heap_samples[slot].address != nullptr) {
+            *sampled_flag(heap_samples[slot].address) = false;
+            heap_samples[slot].address = nullptr;
+        }
     }
-    if (size_aligned >= MMAP_MIN_SIZE) {
-        return mmap_create(size_aligned);
+    heap_samples_live = 0;
+    heap_samples_dropped = 0;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Legacy pprof heap profile ("heap_v2"): pprof scales the sampled counts back up
+ * using the period in the header. Only live samples are kept, so the in-use and
+ * allocated columns are the same. */
+#define HEAP_PROFILE_MAPS_HEADER "\nMAPPED_LIBRARIES:\n"
+
+// writes the line snprintf formatted into a buffer of capacity bytes, cut where snprintf cut it
+static void write_line(int fd, const char* line, int length, size_t capacity) {
+    if (length < 0) {
+        return;
     }
-    size_t index = size_aligned / KB;
-    MallocMetadata* first_in_bin;
-    for (; index < BIN_MAX_SIZE; index++) {
-        first_in_bin = free_bins[index];
-        while (first_in_bin) {
-            if (first_in_bin->size >= size_aligned) {
-                split_block(size_aligned, first_in_bin);
-                first_in_bin->is_free = false;
-                if (first_in_bin->prev_free) {
-                    first_in_bin->prev_free->next_free = first_in_bin->next_free;
-                }
-                if (first_in_bin->next_free) {
-                    first_in_bin->next_free->prev_free = first_in_bin->prev_free;
-                }
-                first_in_bin->next_free = nullptr;
-                first_in_bin->prev_free = nullptr;
-                return first_in_bin->address;
-            }
-            first_in_bin = first_in_bin->next_free;
+    write(fd, line, (size_t)length < capacity ? length : capacity - 1);
+}
+
+void sheap_profile_dump(int fd) {
+    char line[192]; // the header with five 20 digit numbers
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    size_t live_bytes = 0;
+    for (size_t slot = 0; slot < HEAP_PROFILE_SLOTS; slot++) {
+        if (heap_samples[slot].address != nullptr) {
+            live_bytes += heap_samples[slot].size;
         }
     }
-    if (list_block_tail != nullptr and list_block_tail->is_free) {
-        if (sbrk(size_aligned - list_block_tail->size) == (void *)(-1)) {
-            return NULL;
+    int length = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                          heap_samples_live, live_bytes, heap_samples_live, live_bytes, heap_profile_period);
+    write_line(fd, line, length, sizeof(line));
+    for (size_t slot = 0; slot < HEAP_PROFILE_SLOTS; slot++) {
+        HeapSample* sample = &heap_samples[slot];
+        if (sample->address == nullptr) {
+            continue;
         }
-        if (list_block_tail->prev_free == nullptr and list_block_tail->next_free == nullptr) {
-            free_bins[list_block_tail->size / KB] = nullptr;
+        length = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", sample->size, sample->size);
+        write_line(fd, line, length, sizeof(line));
+        for (int frame = 0; frame < sample->depth; frame++) {
+            length = snprintf(line, sizeof(line), " %p", sample->stack[frame]);
+            write_line(fd, line, length, sizeof(line));
         }
-        if (list_block_tail->prev_free != nullptr) {
-            list_block_tail->prev_free->next_free = list_block_tail->next_free;
+        write(fd, "\n", 1);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    write(fd, HEAP_PROFILE_MAPS_HEADER, sizeof(HEAP_PROFILE_MAPS_HEADER) - 1);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps != -1) {
+        char buffer[4096];
+        ssize_t read_bytes;
+        while ((read_bytes = read(maps, buffer, sizeof(buffer))) > 0) {
+            write(fd, buffer, read_bytes);
         }
-        if (list_block_tail->next_free != nullptr) {
-            list_block_tail->next_free->prev_free = list_block_tail->prev_free;
+        close(maps);
+    }
+}
+
+void sheap_walk(SHeapWalkCallback callback, void* arg) {
+    if (callback == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
+    SBlockInfo info;
+    for (MallocMetadata* block = list_block_head; block != nullptr; block = block->next) {
+        info.address = block->address;
+        info.size = block->size;
+        info.is_free = block->is_free;
+        info.is_mmap = false;
+        info.in_fast_bin = block->in_fast_bin;
+        if (block->in_fast_bin) {
+            info.bin = block->size / 8;
+        } else if (block->is_free) {
+            info.bin = bin_index(block->size);
+        } else {
+            info.bin = -1;
         }
-        list_block_tail->is_free = false;
-        list_block_tail->size = size_aligned;
-        return (void*)list_block_tail->address;
+        callback(&info, arg);
     }
-    void* prev_prog_break = sbrk(size_aligned + _size_meta_data());
-    if (prev_prog_break == (void*)(-1)) {
-        return NULL;
+    for (Span* span = page_spans; span != nullptr; span = span->next) {
+        info.address = span_start(span);
+        info.size = span->num_pages * PAGE_BYTES;
+        info.is_free = span->kind == SPAN_FREE_PAGES;
+        info.is_mmap = false;
+        info.in_fast_bin = false;
+        info.bin = info.is_free ? page_list_index(span->num_pages) : -1;
+        callback(&info, arg);
     }
-    ((MallocMetadata*) prev_prog_break)->size = size_aligned;
-    ((MallocMetadata*) prev_prog_break)->is_free = false;
-    ((MallocMetadata*) prev_prog_break)->address = static_cast<char*>(prev_prog_break) + _size_meta_data();
-    if (list_block_head == nullptr){ //case list empty
-        list_block_head = (MallocMetadata*) prev_prog_break;
-        list_block_head->next = nullptr;
-        list_block_head->prev = nullptr;
-        list_block_tail = list_block_head;
-    } else { // new element added to last place
-        /*update prev and next*/
-        list_block_tail->next = (MallocMetadata*) prev_prog_break;
-        ((MallocMetadata*) prev_prog_break)->next = nullptr;
-        ((MallocMetadata*) prev_prog_break)->prev = list_block_tail;
-        list_block_tail = ((MallocMetadata*) prev_prog_break);
+    for (MallocMetadata* block = mmap_list_block_head; block != nullptr; block = block->next) {
+        info.address = block->address;
+        info.size = block->size;
+        info.is_free = false;
+        info.is_mmap = true;
+        info.in_fast_bin = false;
+        info.bin = -1;
+        callback(&info, arg);
     }
-    return ((MallocMetadata*) prev_prog_break)->address;
+    pthread_mutex_unlock(&heap_lock);
 }
 
-void* scalloc(size_t num, size_t size) {
-    size_t size_aligned = aligned_size(size);
-    if (size_aligned == 0 or size_aligned * num > pow(10,8)) {
-        return NULL;
+size_t smalloc_usable_size(void* p) {
+    if (p == NULL) {
+        return 0;
     }
-    void* prev_prog_break = smalloc(num * size_aligned);
-    if (prev_prog_break == NULL) {
-        return NULL;
+    pthread_mutex_lock(&heap_lock);
+    size_t size = 0;
+    Span* span = page_map_get(page_of(p));
+    if (span != nullptr and (span->kind == SPAN_MMAP or is_page_object(span, p))) {
+        size = span->end - (char*)p;
+    } else if (span != nullptr) {
+        size = ((MallocMetadata*)p - 1)->size;
     }
-    void* curr = prev_prog_break;
-    memset(curr, 0, num * size_aligned);
-    return prev_prog_break;
+    pthread_mutex_unlock(&heap_lock);
+    return size;
 }
 
-void sfree(void* p) {
-    if (p == NULL){
-        return;
+/* Regions: objects are bump-allocated from large chunks taken with smalloc
+ * (and so from mmap_create when the chunk is big enough), and are released
+ * all at once by sregion_reset / sregion_destroy. */
+
+struct RegionChunk {
+    RegionChunk* next;
+    size_t size;
+    size_t used;
+};
+
+struct SRegion {
+    RegionChunk* head;
+    size_t chunk_size;
+};
+
+static RegionChunk* region_chunk_create(size_t size) {
+    RegionChunk* chunk = (RegionChunk*)smalloc(aligned_size(sizeof(RegionChunk)) + size);
+    if (chunk == NULL) {
+        return NULL;
     }
-    MallocMetadata* tmp = (MallocMetadata*)p;
-    tmp--;
-    tmp->is_free = true;
-    if (tmp->size >= MMAP_MIN_SIZE) {
-        if (tmp == mmap_list_block_tail) {
-            mmap_list_block_tail = tmp->prev;
-        }
-        if (tmp == mmap_list_block_head) {
-            mmap_list_block_head = tmp->next;
-        }
-        if (tmp->next != nullptr) {
-            tmp->next->prev = tmp->prev;
-        }
-        if (tmp->prev != nullptr) {
-            tmp->prev->next = tmp->next;
-        }
-        munmap((void*)tmp->address, tmp->size + _size_meta_data());
-        return;
+    chunk->next = nullptr;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+SRegion* sregion_create(size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = REGION_CHUNK_SIZE;
     }
-    tmp = merge_free(tmp);
-    size_t index = tmp->size / KB;
-    MallocMetadata* first_in_bin = free_bins[index];
-    if (first_in_bin) {
-        first_in_bin->prev_free = tmp;
-        tmp->next_free = first_in_bin;
-        tmp->prev_free = nullptr;
-        free_bins[index] = tmp;
+    SRegion* region = (SRegion*)smalloc(sizeof(SRegion));
+    if (region == NULL) {
+        return NULL;
     }
-    free_bins[index] = tmp;
+    region->head = nullptr;
+    region->chunk_size = aligned_size(chunk_size);
+    return region;
 }
 
-void* srealloc(void* oldp, size_t size) {
+void* sregion_alloc(SRegion* region, size_t size) {
     size_t size_aligned = aligned_size(size);
-    if (size_aligned == 0 or size_aligned > pow(10,8)) {
+    if (region == NULL or size_aligned == 0 or size_aligned > MAX_SIZE) {
         return NULL;
     }
-    MallocMetadata* oldp_meta_data = nullptr;
-    MallocMetadata* temp = nullptr;
-    if (oldp != NULL) {
-        oldp_meta_data = (MallocMetadata*)oldp;
-        oldp_meta_data--;
-    }
-    if (size_aligned < MMAP_MIN_SIZE) {
-        if (oldp_meta_data == list_block_tail) {
-            if (sbrk(size_aligned - list_block_tail->size) == (void *)(-1)) {
-                return NULL;
-            }
-            if (list_block_tail->prev_free != nullptr) {
-                list_block_tail->prev_free->next_free = list_block_tail->next_free;
-            }
-            if (list_block_tail->next_free != nullptr) {
-                list_block_tail->next_free->prev_free = list_block_tail->prev_free;
-            }
-            list_block_tail->is_free = false;
-            list_block_tail->size = size_aligned;
-            memmove(list_block_tail->address, oldp, oldp_meta_data->size);
-            if (list_block_tail->address != oldp) {
-                sfree((void*)oldp);
-            }
-            return list_block_tail->address;
-        }
-        oldp_meta_data->is_free = true;
-        if (oldp_meta_data->size < size_aligned) {
-            if (oldp_meta_data->prev != nullptr and
-                oldp_meta_data->prev->is_free and
-                oldp_meta_data->size + oldp_meta_data->prev->size >= size_aligned) {
-                if (merge(oldp_meta_data->prev, oldp_meta_data)) {
-                    temp = oldp_meta_data;
-                    oldp_meta_data = oldp_meta_data->prev;
-                    if (oldp_meta_data->prev_free == nullptr and oldp_meta_data->next_free == nullptr) {
-                        free_bins[oldp_meta_data->size / KB] = nullptr;
-                    }
-                    if (oldp_meta_data->prev_free != nullptr) {
-                        oldp_meta_data->prev_free->next_free = oldp_meta_data->next_free;
-                    }
-                    if (oldp_meta_data->next_free != nullptr) {
-                        oldp_meta_data->next_free->prev_free = oldp_meta_data->prev_free;
-                    }
-                    oldp_meta_data->next_free = nullptr;
-                    oldp_meta_data->prev_free = nullptr;
-                }
-            } else if (oldp_meta_data->next != nullptr and
-                       oldp_meta_data->next->is_free and
-                       oldp_meta_data->size + oldp_meta_data->next->size >= size_aligned) {
-                merge(oldp_meta_data, oldp_meta_data->next);
-            }
-            else if (oldp_meta_data->next != nullptr and oldp_meta_data->prev != nullptr and
-                     oldp_meta_data->next->is_free and oldp_meta_data->prev->is_free and
-                     oldp_meta_data->size + oldp_meta_data->next->size + oldp_meta_data->prev->size >= size_aligned) {
-                temp = oldp_meta_data;
-                oldp_meta_data = merge_free(oldp_meta_data);
-                if (oldp_meta_data->prev_free == nullptr and oldp_meta_data->next_free == nullptr) {
-                    free_bins[oldp_meta_data->size / KB] = nullptr;
-                }
-                if (oldp_meta_data->prev_free != nullptr) {
-                    oldp_meta_data->prev_free->next_free = oldp_meta_data->next_free;
-                }
-                if (oldp_meta_data->next_free != nullptr) {
-                    oldp_meta_data->next_free->prev_free = oldp_meta_data->prev_free;
-                }
-                oldp_meta_data->next_free = nullptr;
-                oldp_meta_data->prev_free = nullptr;
-            }
-        }
-        oldp_meta_data->is_free = false;
-        if (oldp_meta_data->size >= size_aligned) {
-            split_block(size_aligned, oldp_meta_data);
-            if (temp != nullptr) {
-                memmove(oldp_meta_data->address, temp->address, temp->size);
-            }
-            return oldp_meta_data->address;
+    size_t needed = size_aligned + _size_meta_data();
+    RegionChunk* chunk = region->head;
+    if (chunk == nullptr or chunk->size - chunk->used < needed) {
+        chunk = region_chunk_create(needed > region->chunk_size ? needed : region->chunk_size);
+        if (chunk == NULL) {
+            return NULL;
         }
-        if (list_block_tail != nullptr and list_block_tail->is_free) {
-            if (sbrk(size_aligned - list_block_tail->size) == (void *)(-1)) {
-                return NULL;
-            }
-            if (list_block_tail->prev_free != nullptr) {
-                list_block_tail->prev_free->next_free = list_block_tail->next_free;
-            }
-            if (list_block_tail->next_free != nullptr) {
-                list_block_tail->next_free->prev_free = list_block_tail->prev_free;
-            }
-            list_block_tail->is_free = false;
-            list_block_tail->size = size_aligned;
-            memmove(list_block_tail->address, oldp, oldp_meta_data->size);
-            if (list_block_tail->address != oldp) {
-                sfree((void*)oldp);
-            }
-            return list_block_tail->address;
+        if (region->head != nullptr and needed > region->chunk_size) {
+            // oversized chunk goes behind the head so the head keeps bumping
+            chunk->next = region->head->next;
+            region->head->next = chunk;
+        } else {
+            chunk->next = region->head;
+            region->head = chunk;
         }
     }
-    void* prev_prog_break = smalloc(size_aligned);
-    if(oldp != NULL and prev_prog_break != NULL){
-        if (size_aligned < oldp_meta_data->size) {
-            memmove(prev_prog_break,oldp,size_aligned);
-        }
-        else {
-            memmove(prev_prog_break,oldp,oldp_meta_data->size);
-        }
-        sfree((void*)oldp);
+    char* base = (char*)chunk + aligned_size(sizeof(RegionChunk));
+    MallocMetadata* block = (MallocMetadata*)(base + chunk->used);
+    chunk->used += needed;
+    block->size = size_aligned;
+    block->is_free = false;
+    block->is_region = true;
+    block->in_fast_bin = false;
+    block->is_sampled = false;
+    block->handle = nullptr;
+    block->is_purged = false;
+    block->address = (char*)block + _size_meta_data();
+    block->next = nullptr;
+    block->prev = nullptr;
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+    return block->address;
+}
+
+void sregion_reset(SRegion* region) {
+    if (region == NULL or region->head == nullptr) {
+        return;
     }
-    return prev_prog_break;
+    RegionChunk* chunk = region->head->next;
+    while (chunk) {
+        RegionChunk* next = chunk->next;
+        sfree(chunk);
+        chunk = next;
+    }
+    region->head->next = nullptr;
+    region->head->used = 0;
+}
+
+void sregion_destroy(SRegion* region) {
+    if (region == NULL) {
+        return;
+    }
+    RegionChunk* chunk = region->head;
+    while (chunk) {
+        RegionChunk* next = chunk->next;
+        sfree(chunk);
+        chunk = next;
+    }
+    sfree(region);
 }
 
 size_t _num_free_blocks() {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
     MallocMetadata* tmp = list_block_head;
     size_t count_of_free_blocks = 0;
     while(tmp) {
@@ -392,10 +2683,18 @@ size_t _num_free_blocks() {
         }
         tmp = tmp->next;
     }
+    for (Span* span = page_spans; span != nullptr; span = span->next) {
+        if (span->kind == SPAN_FREE_PAGES) {
+            ++count_of_free_blocks;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
     return count_of_free_blocks;
 }
 
 size_t _num_free_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
     MallocMetadata* tmp = list_block_head;
     size_t num_of_free_bytes = 0;
     while(tmp) {
@@ -404,10 +2703,14 @@ size_t _num_free_bytes() {
         }
         tmp = tmp->next;
     }
+    num_of_free_bytes += page_heap_free_pages * PAGE_BYTES;
+    pthread_mutex_unlock(&heap_lock);
     return num_of_free_bytes;
 }
 
 size_t _num_allocated_blocks() {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
     MallocMetadata* block_tmp = list_block_head;
     MallocMetadata* mmap_tmp = mmap_list_block_head;
     size_t count_of_allocated_blocks = 0;
@@ -419,10 +2722,16 @@ size_t _num_allocated_blocks() {
         ++count_of_allocated_blocks;
         mmap_tmp = mmap_tmp->next;
     }
+    for (Span* span = page_spans; span != nullptr; span = span->next) {
+        ++count_of_allocated_blocks;
+    }
+    pthread_mutex_unlock(&heap_lock);
     return count_of_allocated_blocks;
 }
 
 size_t _num_allocated_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    drain_remote_frees();
     MallocMetadata* block_tmp = list_block_head;
     MallocMetadata* mmap_tmp = mmap_list_block_head;
     size_t num_of_allocated_bytes = 0;
@@ -434,6 +2743,10 @@ size_t _num_allocated_bytes() {
         num_of_allocated_bytes += mmap_tmp->size;
         mmap_tmp = mmap_tmp->next;
     }
+    for (Span* span = page_spans; span != nullptr; span = span->next) {
+        num_of_allocated_bytes += span->num_pages * PAGE_BYTES;
+    }
+    pthread_mutex_unlock(&heap_lock);
     return num_of_allocated_bytes;
 }
 
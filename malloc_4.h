@@ -0,0 +1,145 @@
+#ifndef OS234123_HW4_MALLOC_4_H
+#define OS234123_HW4_MALLOC_4_H
+
+#include <cstddef>
+
+size_t _size_meta_data();
+
+size_t _num_free_blocks() ;
+
+
+size_t _num_free_bytes();
+
+
+size_t _num_allocated_blocks() ;
+
+size_t _num_allocated_bytes();
+
+
+size_t _num_meta_data_bytes() ;
+
+void* smalloc(size_t size) ;
+
+void* scalloc(size_t num, size_t size) ;
+
+void sfree(void* p) ;
+
+void* srealloc(void* oldp, size_t size) ;
+
+/* Every block is 16 byte aligned. smemalign takes a power of two alignment up
+ * to the page size and returns NULL for anything else. */
+void* smemalign(size_t alignment, size_t size) ;
+
+/* sfree for a caller that knows the size it asked smalloc/srealloc for: small
+ * blocks are freed without the page map lookup. Blocks from smemalign with an
+ * alignment above 16 must go to sfree. */
+void sfree_sized(void* p, size_t size) ;
+
+/* Batches: allocates n blocks of the same size into out, returns n or 0 on failure.
+ * Each block comes from where smalloc would take it: the heap below 4KB, the
+ * page heap up to 128KB, a mapping of its own above. sfree_batch sorts ptrs by
+ * address before freeing them. */
+size_t smalloc_batch(size_t size, size_t n, void** out) ;
+
+void sfree_batch(void** ptrs, size_t n) ;
+
+/* Heap profile: samples about one allocation per sample_period bytes (0 picks
+ * 512KB) with its stack until it is freed, and dumps the live samples in the
+ * legacy pprof heap format. */
+void sheap_profile_start(size_t sample_period) ;
+
+void sheap_profile_stop() ;
+
+void sheap_profile_dump(int fd) ;
+
+/* Decay: starts a background thread that gives free memory back to the OS on
+ * a smooth curve, so memory left free for decay_ms (0 picks 10 s) is returned
+ * and memory reused sooner is kept. Returns false if it is already running. */
+bool sdecay_start(size_t decay_ms) ;
+
+void sdecay_stop() ;
+
+/* Bytes the decay thread has handed back so far. */
+size_t sdecay_purged_bytes() ;
+
+/* Per-CPU caches: while they run, smalloc, sfree and sfree_sized serve blocks
+ * up to 256 bytes from a cache owned by the current CPU, through rseq critical
+ * sections, or from per-thread caches (malloc_4_inline.h) where rseq is not
+ * available. Cached blocks count as allocated until scpu_cache_stop returns
+ * them. Returns false if they are already running. */
+bool scpu_cache_start() ;
+
+void scpu_cache_stop() ;
+
+/* Whether the running caches are per CPU rather than per thread. */
+bool scpu_cache_per_cpu() ;
+
+/* Handles: blocks the allocator may move. shandle_pin returns the block's
+ * current address, which stays valid until the matching shandle_unpin (pins
+ * nest); the handle itself stays valid until shandle_free. scompact slides the
+ * unpinned handle blocks down the sbrk heap over the free blocks before them,
+ * then gives the free tail back to the OS, and returns the bytes it gave back.
+ * Only handle blocks move: a pinned or ordinary block keeps the free space in
+ * front of it. The address of a handle block must not go to sfree or srealloc. */
+struct SHandleEntry;
+
+typedef SHandleEntry* SHandle;
+
+SHandle shandle_alloc(size_t size) ;
+
+void shandle_free(SHandle handle) ;
+
+void* shandle_pin(SHandle handle) ;
+
+void shandle_unpin(SHandle handle) ;
+
+size_t scompact() ;
+
+/* Telemetry: publishes the allocator's counters in the shared memory object
+ * /smalloc.<pid> (laid out in malloc_4_telemetry.h) for smalloc-top to read.
+ * Returns false if it is already running or the object cannot be created. */
+bool stelemetry_start() ;
+
+void stelemetry_stop() ;
+
+#ifdef MALLOC_PATH_STATS
+/* Writes the hit count and rdtsc cycles of every allocator path taken so far to fd. */
+void spath_stats_dump(int fd) ;
+
+/* Name of the path the most recent smalloc/sfree/srealloc took, for single threaded callers. */
+const char* spath_stats_last() ;
+#endif
+
+/* Heap walk: calls callback once per block, sbrk heap first, then page heap runs
+ * and then mmap blocks, in one pass and without allocating. The heap stays locked during the walk, so
+ * the callback must not call smalloc/srealloc. */
+struct SBlockInfo {
+    void* address;
+    size_t size;
+    bool is_free;
+    bool is_mmap;
+    bool in_fast_bin;
+    int bin; // free bin (or fast bin) index, -1 when not in a bin
+};
+
+typedef void (*SHeapWalkCallback)(const SBlockInfo* block, void* arg);
+
+void sheap_walk(SHeapWalkCallback callback, void* arg) ;
+
+/* Bytes usable at p, found through the page map: 0 when p is NULL or does not
+ * come from this heap. */
+size_t smalloc_usable_size(void* p) ;
+
+/* Regions: bump allocation, freed all at once. sfree on a region block is a no-op.
+ * chunk_size 0 picks the default chunk size. */
+struct SRegion;
+
+SRegion* sregion_create(size_t chunk_size) ;
+
+void* sregion_alloc(SRegion* region, size_t size) ;
+
+void sregion_reset(SRegion* region) ;
+
+void sregion_destroy(SRegion* region) ;
+
+#endif //OS234123_HW4_MALLOC_4_H
@@ -0,0 +1,170 @@
+#ifndef OS234123_HW4_MALLOC_4_ALLOCATOR_H
+#define OS234123_HW4_MALLOC_4_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "malloc_4.h"
+
+/* SPool: a fixed-size pool of T. Chunks of objects_per_chunk slots come from
+ * smalloc, freed slots go on a free list threaded through them, and all chunks
+ * go back to sfree with the pool. The pool does not run destructors for objects
+ * still alive when it is destroyed. Not thread safe. */
+template <typename T>
+class SPool {
+public:
+    explicit SPool(size_t objects_per_chunk = 0) :
+        objects_per_chunk(objects_per_chunk != 0 ? objects_per_chunk : default_objects_per_chunk()),
+        chunks(nullptr), free_slots(nullptr) {}
+
+    SPool(const SPool&) = delete;
+    SPool& operator=(const SPool&) = delete;
+
+    ~SPool() {
+        while (chunks != nullptr) {
+            Chunk* next = chunks->next;
+            sfree(chunks);
+            chunks = next;
+        }
+    }
+
+    // raw storage for one T, nullptr when smalloc fails
+    void* allocate() {
+        if (free_slots == nullptr and not add_chunk()) {
+            return nullptr;
+        }
+        Slot* slot = free_slots;
+        free_slots = slot->next;
+        return slot;
+    }
+
+    void deallocate(void* p) {
+        if (p == nullptr) {
+            return;
+        }
+        Slot* slot = static_cast<Slot*>(p);
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        void* p = allocate();
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        try {
+            return new (p) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(p);
+            throw;
+        }
+    }
+
+    void destroy(T* object) {
+        if (object != nullptr) {
+            object->~T();
+            deallocate(object);
+        }
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    struct alignas(16) Chunk { // keeps the slots after it 16 byte aligned
+        Chunk* next;
+    };
+
+    static_assert(alignof(T) <= 16, "smalloc only guarantees 16 byte alignment");
+
+    static size_t default_objects_per_chunk() {
+        size_t objects = (64 * 1024 - sizeof(Chunk)) / sizeof(Slot);
+        return objects > 0 ? objects : 1;
+    }
+
+    bool add_chunk() {
+        Chunk* chunk = static_cast<Chunk*>(smalloc(sizeof(Chunk) + objects_per_chunk * sizeof(Slot)));
+        if (chunk == nullptr) {
+            return false;
+        }
+        chunk->next = chunks;
+        chunks = chunk;
+        Slot* slots = reinterpret_cast<Slot*>(chunk + 1);
+        for (size_t i = objects_per_chunk; i > 0; i--) {
+            slots[i - 1].next = free_slots;
+            free_slots = &slots[i - 1];
+        }
+        return true;
+    }
+
+    size_t objects_per_chunk;
+    Chunk* chunks;
+    Slot* free_slots;
+};
+
+/* SAllocator: a stateless std::allocator replacement on top of smalloc/sfree
+ * for the standard containers. All instances compare equal, so containers may
+ * move, copy and swap their memory between each other freely. */
+template <typename T>
+class SAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::true_type is_always_equal;
+
+    template <typename U>
+    struct rebind {
+        typedef SAllocator<U> other;
+    };
+
+    static_assert(alignof(T) <= 16, "smalloc only guarantees 16 byte alignment");
+
+    SAllocator() noexcept {}
+
+    template <typename U>
+    SAllocator(const SAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > max_size()) {
+            throw std::bad_alloc();
+        }
+        void* p = smalloc(n * sizeof(T));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) noexcept {
+        sfree(p);
+    }
+
+    // smalloc refuses anything above 10^8 bytes
+    size_t max_size() const noexcept {
+        return 100000000 / sizeof(T);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SAllocator<T>&, const SAllocator<U>&) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SAllocator<T>&, const SAllocator<U>&) noexcept {
+    return false;
+}
+
+#endif //OS234123_HW4_MALLOC_4_ALLOCATOR_H
@@ -0,0 +1,66 @@
+#ifndef OS234123_HW4_MALLOC_4_INLINE_H
+#define OS234123_HW4_MALLOC_4_INLINE_H
+
+#include <cstddef>
+#include "malloc_4.h"
+
+/* Inline fast path: smalloc_inline and sfree_inline keep a per-thread LIFO of
+ * blocks for every 16 byte size class up to SINLINE_MAX_SIZE and serve a hit
+ * right here, with no call, no lock and no bin walk. A miss on smalloc_inline
+ * refills the class with one smalloc_batch; sfree_inline on a full class hands
+ * half of it back with one sfree_batch. Bigger sizes go straight to smalloc and
+ * sfree_sized.
+ *
+ * Blocks waiting in a thread's lists count as allocated in the _num_* totals
+ * until sinline_flush, which the thread exit runs as well, returns them.
+ * sfree_inline takes blocks from smalloc_inline (or any thread's smalloc_inline)
+ * with the size they were asked for; blocks from smalloc, smemalign or a region
+ * go to sfree. */
+
+#define SINLINE_MAX_SIZE 256
+#define SINLINE_CLASSES (SINLINE_MAX_SIZE / 16)
+#define SINLINE_MAX_COUNT 64
+
+struct SInlineCache {
+    void* heads[SINLINE_CLASSES + 1]; // by (size + 15) / 16, entry 0 unused
+    // free slots left in each list, 0 until the thread's first slow call arms
+    // its exit flush, so a thread that only ever frees arms it too
+    unsigned room[SINLINE_CLASSES + 1];
+};
+
+// __thread rather than thread_local: a trivial type needs no TLS init wrapper call
+extern __thread SInlineCache sinline_cache;
+
+void* sinline_alloc_slow(size_t size) ;
+
+void sinline_free_slow(void* p, size_t size) ;
+
+/* Returns the calling thread's cached blocks to the heap. */
+void sinline_flush() ;
+
+inline void* smalloc_inline(size_t size) {
+    size_t index = (size + 15) / 16;
+    if (__builtin_expect(index - 1 < SINLINE_CLASSES, 1)) { // size 0 wraps around
+        void* head = sinline_cache.heads[index];
+        if (__builtin_expect(head != nullptr, 1)) {
+            sinline_cache.heads[index] = *(void**)head;
+            sinline_cache.room[index]++;
+            return head;
+        }
+    }
+    return sinline_alloc_slow(size);
+}
+
+inline void sfree_inline(void* p, size_t size) {
+    size_t index = (size + 15) / 16;
+    if (__builtin_expect(p != nullptr and index - 1 < SINLINE_CLASSES and
+                         sinline_cache.room[index] != 0, 1)) {
+        *(void**)p = sinline_cache.heads[index];
+        sinline_cache.heads[index] = p;
+        sinline_cache.room[index]--;
+        return;
+    }
+    sinline_free_slow(p, size);
+}
+
+#endif //OS234123_HW4_MALLOC_4_INLINE_H
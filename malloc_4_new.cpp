@@ -0,0 +1,128 @@
+/*
+Replaces every global operator new and operator delete with malloc_4. Link it
+next to malloc_4.cpp and all C++ allocations go to smalloc.
+
+Plain new relies on smalloc's 16 byte alignment (__STDCPP_DEFAULT_NEW_ALIGNMENT__
+on x86-64), the std::align_val_t forms (C++17) take smemalign and fail above
+the page size. Sized delete hands its size to sfree_sized, which frees small
+blocks without the page map lookup. The nothrow forms return nullptr where the
+others throw std::bad_alloc, both after the new_handler gave up.
+ */
+
+#include <new>
+#include "malloc_4.h"
+
+// smalloc's alignment, what plain new owes on x86-64
+#define NEW_ALIGNMENT 16
+
+static void* allocate(std::size_t size, std::size_t alignment) {
+    if (size == 0) { // every new returns a distinct pointer
+        size = 1;
+    }
+    for (;;) {
+        void* p = alignment <= NEW_ALIGNMENT ? smalloc(size) : smemalign(alignment, size);
+        if (p != nullptr) {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* allocate_nothrow(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size) {
+    return allocate(size, NEW_ALIGNMENT);
+}
+
+void* operator new[](std::size_t size) {
+    return allocate(size, NEW_ALIGNMENT);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return allocate_nothrow(size, NEW_ALIGNMENT);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return allocate_nothrow(size, NEW_ALIGNMENT);
+}
+
+void operator delete(void* p) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p) noexcept {
+    sfree(p);
+}
+
+void operator delete(void* p, std::size_t size) noexcept {
+    sfree_sized(p, size);
+}
+
+void operator delete[](void* p, std::size_t size) noexcept {
+    sfree_sized(p, size);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+
+#ifdef __cpp_aligned_new
+static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__ <= NEW_ALIGNMENT, "plain new would hand out under-aligned blocks");
+
+/* Over-aligned blocks can be page runs whatever their size, so their deletes
+ * ignore the size and take the page map path in sfree. */
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    sfree(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+    sfree(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+#endif
@@ -0,0 +1,172 @@
+/*
+Tests for the operator new/delete replacement (malloc_4_new.cpp), linked with
+malloc_4.cpp. Every test runs in a forked child.
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include "malloc_4.h"
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_new_and_delete_use_smalloc() {
+	size_t blocks = _num_allocated_blocks();
+	size_t used = _num_allocated_blocks() - _num_free_blocks();
+	long *value = new long(42);
+	assert(_num_allocated_blocks() - _num_free_blocks() == used + 1);
+	assert(smalloc_usable_size(value) == 16);
+	assert(reinterpret_cast<size_t>(value) % 16 == 0);
+	delete value;
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	char *array = new char[6000];
+	assert(smalloc_usable_size(array) >= 6000);
+	delete[] array;
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	char *empty = new char[0];
+	char *other = new char[0];
+	assert(empty != other);
+	delete[] empty;
+	delete[] other;
+	assert(_num_allocated_blocks() >= blocks);
+}
+
+void test_sized_delete() {
+	size_t used = _num_allocated_blocks() - _num_free_blocks();
+	void *small = ::operator new(100);
+	void *pages = ::operator new(20000);
+	::operator delete(small, 100);
+	::operator delete(pages, 20000);
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	// the block went to its fast bin, the next new of that size takes it back
+	assert(::operator new(100) == small);
+}
+
+struct alignas(64) CacheLine {
+	char bytes[64];
+};
+
+struct alignas(4096) Page {
+	char bytes[4096];
+};
+
+void test_aligned_new() {
+	std::vector<CacheLine*> lines;
+	for (int i = 0; i < 100; ++i) {
+		lines.push_back(new CacheLine);
+		assert(reinterpret_cast<size_t>(lines.back()) % 64 == 0);
+		memset(lines.back()->bytes, i, 64);
+	}
+	CacheLine *array = new CacheLine[7];
+	assert(reinterpret_cast<size_t>(array) % 64 == 0);
+	Page *page = new Page;
+	assert(reinterpret_cast<size_t>(page) % 4096 == 0);
+	for (int i = 0; i < 100; ++i) {
+		assert(lines[i]->bytes[63] == (char)i);
+		delete lines[i];
+	}
+	delete[] array;
+	delete page;
+	assert(_num_free_blocks() > 0);
+	void *nothrow = ::operator new(100, std::align_val_t(256), std::nothrow);
+	assert(reinterpret_cast<size_t>(nothrow) % 256 == 0);
+	::operator delete(nothrow, std::align_val_t(256), std::nothrow);
+	// smemalign stops at the page size
+	assert(::operator new(100, std::align_val_t(8192), std::nothrow) == nullptr);
+}
+
+static int handler_calls = 0;
+
+static void give_up() {
+	handler_calls++;
+	std::set_new_handler(nullptr);
+}
+
+void test_failures() {
+	assert(new (std::nothrow) char[200000000] == nullptr);
+	bool thrown = false;
+	try {
+		char *huge = new char[200000000];
+		delete[] huge;
+	} catch (const std::bad_alloc &) {
+		thrown = true;
+	}
+	assert(thrown);
+	std::set_new_handler(give_up);
+	thrown = false;
+	try {
+		char *huge = new char[200000000];
+		delete[] huge;
+	} catch (const std::bad_alloc &) {
+		thrown = true;
+	}
+	assert(thrown);
+	assert(handler_calls == 1);
+}
+
+void test_standard_containers() {
+	std::map<int, std::string> names;
+	std::vector<std::string> words;
+	for (int i = 0; i < 5000; ++i) {
+		names[i] = std::string(i % 100 + 20, 'a' + i % 26);
+		words.push_back(names[i]);
+	}
+	for (int i = 0; i < 5000; i += 2) {
+		names.erase(i);
+	}
+	for (int i = 1; i < 5000; i += 2) {
+		assert(names[i] == words[i]);
+	}
+	names.clear();
+	words.clear();
+	words.shrink_to_fit();
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static int failures = 0;
+
+static void callTestFunction(void (*func)()) {
+	if (!fork()) {  // test as son, to get a clear heap
+		func();
+		exit(0);
+	} else {		// father waits for son before continuing to next test
+		int exit_status = 0;
+		wait(&exit_status);
+		if (!exit_status)
+			return;
+		++failures;
+		if (WIFEXITED(exit_status) && WEXITSTATUS(exit_status))
+			std::cout << "Exit status ERROR " << WEXITSTATUS(exit_status) << ". ";
+		if (WIFSIGNALED(exit_status))
+			std::cout << "Error signal " << WTERMSIG(exit_status);
+		std::cout << std::endl;
+	}
+}
+
+int main()
+{
+	std::cout << "test_new_and_delete_use_smalloc" << std::endl;
+	callTestFunction(test_new_and_delete_use_smalloc);
+	std::cout << "test_sized_delete" << std::endl;
+	callTestFunction(test_sized_delete);
+	std::cout << "test_aligned_new" << std::endl;
+	callTestFunction(test_aligned_new);
+	std::cout << "test_failures" << std::endl;
+	callTestFunction(test_failures);
+	std::cout << "test_standard_containers" << std::endl;
+	callTestFunction(test_standard_containers);
+	std::cout << "Done." << std::endl;
+	return failures != 0;
+}
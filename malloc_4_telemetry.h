@@ -0,0 +1,86 @@
+#ifndef OS234123_HW4_MALLOC_4_TELEMETRY_H
+#define OS234123_HW4_MALLOC_4_TELEMETRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/* Telemetry page: the counters malloc_4 publishes in the POSIX shared memory
+ * object /smalloc.<pid> while stelemetry_start is in effect. The heap lock
+ * holder keeps them up to date with relaxed stores, so a reader that maps the
+ * page (smalloc-top does) can see one counter a step ahead of another but never
+ * a torn value. The page holds the parts the totals are made of; the
+ * stelemetry_* functions below add them up the way the _num_* functions do. */
+
+#define STELEMETRY_MAGIC 0x736d616c6c6f6374ULL // "smalloct"
+#define STELEMETRY_VERSION 1
+#define STELEMETRY_BINS 128
+
+struct STelemetry {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t pid;
+    uint64_t meta_data_size;
+    // blocks on the sbrk heap, and the bytes the heap grew by (headers and alignment padding included)
+    uint64_t heap_blocks;
+    uint64_t heap_bytes;
+    uint64_t heap_padding_bytes;
+    // free heap blocks by size bin (1KB steps) and in the fast bins
+    uint64_t bin_blocks[STELEMETRY_BINS];
+    uint64_t bin_bytes[STELEMETRY_BINS];
+    uint64_t fast_bin_blocks;
+    uint64_t fast_bin_bytes;
+    // page heap runs, free or not, and the free ones
+    uint64_t page_runs;
+    uint64_t page_bytes;
+    uint64_t page_free_runs;
+    uint64_t page_free_bytes;
+    uint64_t mmap_blocks;
+    uint64_t mmap_bytes;
+    // calls
+    uint64_t smalloc_calls;
+    uint64_t sfree_calls;
+    uint64_t srealloc_calls;
+    uint64_t remote_frees;
+    // system calls
+    uint64_t sbrk_calls;
+    uint64_t mmap_calls;
+    uint64_t munmap_calls;
+    uint64_t mprotect_calls;
+    uint64_t madvise_calls;
+};
+
+inline void stelemetry_name(char* name, size_t size, long pid) {
+    snprintf(name, size, "/smalloc.%ld", pid);
+}
+
+inline uint64_t stelemetry_allocated_blocks(const STelemetry* t) {
+    return t->heap_blocks + t->page_runs + t->mmap_blocks;
+}
+
+inline uint64_t stelemetry_allocated_bytes(const STelemetry* t) {
+    uint64_t heap_payload = t->heap_bytes - t->heap_padding_bytes - t->heap_blocks * t->meta_data_size;
+    return heap_payload + t->page_bytes + t->mmap_bytes;
+}
+
+inline uint64_t stelemetry_free_blocks(const STelemetry* t) {
+    uint64_t blocks = t->fast_bin_blocks + t->page_free_runs;
+    for (size_t index = 0; index < STELEMETRY_BINS; index++) {
+        blocks += t->bin_blocks[index];
+    }
+    return blocks;
+}
+
+inline uint64_t stelemetry_free_bytes(const STelemetry* t) {
+    uint64_t bytes = t->fast_bin_bytes + t->page_free_bytes;
+    for (size_t index = 0; index < STELEMETRY_BINS; index++) {
+        bytes += t->bin_bytes[index];
+    }
+    return bytes;
+}
+
+inline uint64_t stelemetry_meta_data_bytes(const STelemetry* t) {
+    return stelemetry_allocated_blocks(t) * t->meta_data_size;
+}
+
+#endif //OS234123_HW4_MALLOC_4_TELEMETRY_H
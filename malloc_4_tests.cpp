@@ -0,0 +1,856 @@
+/*
+Tests for the malloc_4 extensions (regions, ...).
+Every test runs in a forked child so it starts from a clean heap.
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <iostream>
+#include <map>
+#include <vector>
+#include "malloc_4.h"
+#include "malloc_4_allocator.h"
+#include "malloc_4_inline.h"
+#include "malloc_4_telemetry.h"
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_region_alloc_and_destroy() {
+	size_t initial_blocks = _num_allocated_blocks();
+	SRegion *region = sregion_create(0);
+	assert(region != NULL);
+	char *objects[1000];
+	for (int i = 0; i < 1000; ++i) {
+		objects[i] = static_cast<char*>(sregion_alloc(region, 100));
+		assert(objects[i] != NULL);
+		assert(reinterpret_cast<size_t>(objects[i]) % 16 == 0);
+		memset(objects[i], i % 256, 100);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		assert(static_cast<unsigned char>(objects[i][99]) == i % 256);
+	}
+	size_t blocks = _num_allocated_blocks();
+	sfree(objects[10]);
+	sfree(objects[500]);
+	assert(_num_allocated_blocks() == blocks);
+	assert(static_cast<unsigned char>(objects[10][0]) == 10);
+	sregion_destroy(region);
+	assert(_num_allocated_blocks() == initial_blocks + 1);
+	assert(_num_free_blocks() == 1);
+}
+
+void test_region_reset_and_oversized() {
+	SRegion *region = sregion_create(4096);
+	assert(region != NULL);
+	void *small = sregion_alloc(region, 16);
+	void *big = sregion_alloc(region, 10000);
+	void *after_big = sregion_alloc(region, 16);
+	assert(small != NULL and big != NULL and after_big != NULL);
+	assert(static_cast<char*>(after_big) - static_cast<char*>(small) == 16 + (long)_size_meta_data());
+	sregion_reset(region);
+	void *again = sregion_alloc(region, 16);
+	assert(again == small);
+	char *moved = static_cast<char*>(srealloc(again, 200));
+	assert(moved != NULL and moved != again);
+	sfree(moved);
+	sregion_destroy(region);
+}
+
+void test_batch_alloc_and_free() {
+	size_t initial_blocks = _num_allocated_blocks();
+	void *blocks[64];
+	assert(smalloc_batch(100, 64, blocks) == 64);
+	assert(_num_allocated_blocks() == initial_blocks + 64);
+	assert(_num_free_blocks() == 0);
+	for (int i = 0; i < 64; ++i) {
+		memset(blocks[i], i, 100);
+		if (i > 0) {
+			assert(static_cast<char*>(blocks[i]) - static_cast<char*>(blocks[i - 1]) == 112 + (long)_size_meta_data());
+		}
+	}
+	for (int i = 0; i < 64; ++i) {
+		assert(static_cast<char*>(blocks[i])[99] == i);
+	}
+	void *first = blocks[0];
+	// free every other block in reverse order, then the rest
+	void *odd[32], *even[32];
+	for (int i = 0; i < 32; ++i) {
+		even[i] = blocks[62 - 2 * i];
+		odd[i] = blocks[63 - 2 * i];
+	}
+	sfree_batch(even, 32);
+	assert(_num_free_blocks() == 32);
+	sfree_batch(odd, 32);
+	assert(_num_free_blocks() == 1);
+	assert(_num_allocated_blocks() == initial_blocks + 1);
+
+	// the merged run is carved again in one piece, the rest stays free
+	assert(smalloc_batch(100, 10, blocks) == 10);
+	assert(blocks[0] == first);
+	assert(_num_free_blocks() == 1);
+	assert(smalloc_batch(200 * 1024, 2, blocks) == 2);
+	sfree_batch(blocks, 2);
+	// page sized batches are runs of pages with no headers between them, as from smalloc
+	assert(smalloc_batch(8192, 4, blocks) == 4);
+	assert(reinterpret_cast<size_t>(blocks[0]) % 4096 == 0);
+	for (int i = 0; i < 4; ++i) {
+		memset(blocks[i], i, 8192);
+		if (i > 0) {
+			assert(static_cast<char*>(blocks[i]) == static_cast<char*>(blocks[i - 1]) + 8192);
+		}
+	}
+	sfree_batch(blocks, 4);
+	assert(smalloc_batch(0, 2, blocks) == 0);
+}
+
+void test_fast_bins_reuse_and_consolidate() {
+	void *a = smalloc(64), *b = smalloc(64), *c = smalloc(64);
+	void *guard = smalloc(1000);
+	size_t blocks = _num_allocated_blocks();
+	sfree(b);
+	sfree(a);
+	// small frees are not merged, and the last freed block is reused first
+	assert(_num_allocated_blocks() == blocks);
+	assert(_num_free_blocks() == 2);
+	assert(smalloc(64) == a);
+	assert(smalloc(60) == b);
+	sfree(a);
+	sfree(b);
+	sfree(c);
+	// a miss merges the fast bins and is served from the merged block
+	void *big = smalloc(2 * 64 + (long)_size_meta_data());
+	assert(big == a);
+	assert(_num_free_blocks() == 0);
+	assert(_num_allocated_blocks() == blocks - 2);
+	sfree(big);
+	sfree(guard);
+	assert(_num_free_blocks() == 1);
+}
+
+#define HANDOFF_THREADS 4
+#define HANDOFF_ROUNDS 20000
+
+static void *volatile handoff_slots[HANDOFF_THREADS][64];
+
+static void *handoff_worker(void *arg) {
+	long id = reinterpret_cast<long>(arg);
+	unsigned seed = id;
+	for (int i = 0; i < HANDOFF_ROUNDS; ++i) {
+		// free a block allocated by the next thread, then put one of our own in our slot
+		int slot = rand_r(&seed) % 64;
+		void *theirs = __atomic_exchange_n(&handoff_slots[(id + 1) % HANDOFF_THREADS][slot], (void*)NULL, __ATOMIC_ACQ_REL);
+		if (theirs != NULL) {
+			assert(*static_cast<long*>(theirs) == (id + 1) % HANDOFF_THREADS);
+			sfree(theirs);
+		}
+		long *mine = static_cast<long*>(smalloc(8 + rand_r(&seed) % 512));
+		assert(mine != NULL);
+		*mine = id;
+		void *old = __atomic_exchange_n(&handoff_slots[id][slot], (void*)mine, __ATOMIC_ACQ_REL);
+		if (old != NULL) {
+			sfree(old);
+		}
+	}
+	return NULL;
+}
+
+void test_cross_thread_frees() {
+	pthread_t threads[HANDOFF_THREADS];
+	for (long i = 0; i < HANDOFF_THREADS; ++i) {
+		assert(pthread_create(&threads[i], NULL, handoff_worker, reinterpret_cast<void*>(i)) == 0);
+	}
+	for (int i = 0; i < HANDOFF_THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	for (int i = 0; i < HANDOFF_THREADS; ++i) {
+		for (int slot = 0; slot < 64; ++slot) {
+			sfree(handoff_slots[i][slot]);
+		}
+	}
+	// every block came back, including the ones handed over while the heap was busy
+	assert(_num_free_blocks() == _num_allocated_blocks());
+}
+
+struct WalkTotals {
+	size_t blocks, free_blocks, free_bytes, mmap_blocks, bytes;
+	void *last;
+};
+
+static void count_block(const SBlockInfo *block, void *arg) {
+	WalkTotals *totals = static_cast<WalkTotals*>(arg);
+	assert(block->is_free == (block->bin != -1));
+	totals->blocks++;
+	totals->bytes += block->size;
+	totals->free_blocks += block->is_free;
+	totals->free_bytes += block->is_free ? block->size : 0;
+	totals->mmap_blocks += block->is_mmap;
+	totals->last = block->address;
+}
+
+void test_heap_walk() {
+	void *a = smalloc(64), *b = smalloc(3000), *c = smalloc(5000), *d = smalloc(200 * 1024);
+	assert(a and b and c and d);
+	sfree(a);
+	sfree(b);
+	WalkTotals totals = {0, 0, 0, 0, 0, NULL};
+	sheap_walk(count_block, &totals);
+	assert(totals.blocks == _num_allocated_blocks());
+	assert(totals.bytes == _num_allocated_bytes());
+	assert(totals.free_blocks == _num_free_blocks());
+	assert(totals.free_bytes == _num_free_bytes());
+	assert(totals.mmap_blocks == 1);
+	assert(totals.last == d);
+}
+
+static int count_lines(int fd, const char *prefix, size_t *matching) {
+	static char text[1 << 16];
+	lseek(fd, 0, SEEK_SET);
+	ssize_t length = read(fd, text, sizeof(text) - 1);
+	assert(length > 0);
+	text[length] = 0;
+	int lines = 0;
+	*matching = 0;
+	for (char *line = text; line and *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+		++lines;
+		if (strncmp(line, prefix, strlen(prefix)) == 0)
+			++*matching;
+	}
+	return lines;
+}
+
+void test_heap_profile() {
+	char path[] = "/tmp/malloc_4_profileXXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+	sheap_profile_start(1);
+	void *kept[3];
+	for (int i = 0; i < 3; ++i)
+		kept[i] = smalloc(1000 + i);
+	void *gone = smalloc(500);
+	kept[2] = srealloc(kept[2], 3000);
+	sfree(gone);
+	sheap_profile_dump(fd);
+	size_t samples = 0;
+	count_lines(fd, "1: ", &samples);
+	assert(samples == 3);
+	size_t header = 0;
+	count_lines(fd, "heap profile: 3: 5001 [3: 5001] @ heap_v2/1", &header);
+	assert(header == 1);
+	sheap_profile_stop();
+	for (int i = 0; i < 3; ++i)
+		sfree(kept[i]);
+	close(fd);
+}
+
+void test_heap_profile_batch_free() {
+	char path[] = "/tmp/malloc_4_profileXXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+	sheap_profile_start(1);
+	void *blocks[10];
+	for (int i = 0; i < 10; ++i)
+		blocks[i] = smalloc(200);
+	sfree_batch(blocks, 10);
+	sheap_profile_dump(fd);
+	size_t samples = 0;
+	count_lines(fd, "1: ", &samples);
+	assert(samples == 0);
+	size_t header = 0;
+	count_lines(fd, "heap profile: 0: 0 [0: 0] @ heap_v2/1\n", &header);
+	assert(header == 1);
+	// the dump is text through to the last mapping
+	static char text[1 << 16];
+	lseek(fd, 0, SEEK_SET);
+	ssize_t length = read(fd, text, sizeof(text));
+	assert(length > 0 && memchr(text, 0, length) == NULL);
+	sheap_profile_stop();
+	close(fd);
+}
+
+void test_heap_profile_failed_realloc() {
+	char path[] = "/tmp/malloc_4_profileXXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+	sheap_profile_start(1);
+	void *heap_block = smalloc(1000);
+	void *page_block = smalloc(8000);
+	// leave no address space for the 50MB mapping, both blocks stay where they are
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	assert(statm != NULL && fscanf(statm, "%ld", &pages) == 1);
+	fclose(statm);
+	rlimit limit = {0, 0};
+	getrlimit(RLIMIT_AS, &limit);
+	limit.rlim_cur = pages * sysconf(_SC_PAGESIZE) + (16 << 20);
+	assert(setrlimit(RLIMIT_AS, &limit) == 0);
+	assert(srealloc(heap_block, 50000000) == NULL);
+	assert(srealloc(page_block, 50000000) == NULL);
+	sheap_profile_dump(fd);
+	size_t samples = 0;
+	count_lines(fd, "1: ", &samples);
+	assert(samples == 2);
+	size_t header = 0;
+	count_lines(fd, "heap profile: 2: 9000 [2: 9000] @ heap_v2/1", &header);
+	assert(header == 1);
+	sfree(heap_block);
+	sfree(page_block);
+	assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+	sheap_profile_dump(fd);
+	count_lines(fd, "1: ", &samples);
+	assert(samples == 0);
+	sheap_profile_stop();
+	close(fd);
+}
+
+void test_page_heap() {
+	char *small = static_cast<char*>(smalloc(64));
+	char *a = static_cast<char*>(smalloc(4096));
+	char *b = static_cast<char*>(smalloc(5000));
+	char *c = static_cast<char*>(smalloc(4096));
+	assert(reinterpret_cast<size_t>(a) % 4096 == 0);
+	assert(b == a + 4096 and c == b + 8192);
+	assert(smalloc_usable_size(b) == 8192);
+	char *small_after = static_cast<char*>(smalloc(64));
+	assert(small_after == small + 64 + _size_meta_data()); // the heap stays free of medium blocks
+	size_t free_blocks = _num_free_blocks();
+	sfree(a);
+	sfree(b);
+	assert(_num_free_blocks() == free_blocks + 1);
+	c = static_cast<char*>(srealloc(c, 20000));
+	assert(c == a + 12288); // grown into the free run behind it
+	assert(srealloc(c, 6000) == c);
+	assert(smalloc_usable_size(c) == 8192);
+	sfree(c);
+	char *runs[40];
+	for (int i = 0; i < 40; ++i) {
+		runs[i] = static_cast<char*>(smalloc(100 * 1024));
+		memset(runs[i], i, 100 * 1024);
+	}
+	for (int i = 0; i < 40; ++i)
+		sfree(runs[i]);
+	// everything beyond one growth step is handed back
+	assert(_num_free_bytes() <= 1024 * 1024 + 2 * 64 + 1024);
+	sfree(small);
+	sfree(small_after);
+}
+
+void test_decay() {
+	assert(sdecay_start(300));
+	assert(not sdecay_start(300));
+	char *blocks[200];
+	for (int i = 0; i < 200; ++i) {
+		blocks[i] = static_cast<char*>(smalloc(3000));
+		memset(blocks[i], 1, 3000);
+	}
+	char *guard = static_cast<char*>(smalloc(64));
+	memset(guard, 7, 64);
+	char *tail[100];
+	for (int i = 0; i < 100; ++i) {
+		tail[i] = static_cast<char*>(smalloc(3000));
+		memset(tail[i], 1, 3000);
+	}
+	char *runs[20];
+	for (int i = 0; i < 20; ++i) {
+		runs[i] = static_cast<char*>(smalloc(100 * 1024));
+		memset(runs[i], 1, 100 * 1024);
+	}
+#ifndef MALLOC_RESERVED_HEAP
+	void *heap_end = sbrk(0);
+#endif
+	for (int i = 0; i < 200; ++i)
+		sfree(blocks[i]);
+	for (int i = 0; i < 100; ++i)
+		sfree(tail[i]);
+	for (int i = 0; i < 20; ++i)
+		sfree(runs[i]);
+	size_t freed = 600000 + 300000 + 2000 * 1024;
+	assert(sdecay_purged_bytes() < freed / 2); // nothing goes back at once
+	usleep(600 * 1000);
+	assert(sdecay_purged_bytes() > freed * 9 / 10);
+#ifndef MALLOC_RESERVED_HEAP
+	assert(sbrk(0) < heap_end);
+#endif
+	for (int i = 0; i < 64; ++i)
+		assert(guard[i] == 7);
+	char *reused = static_cast<char*>(smalloc(300000 / 2));
+	memset(reused, 2, 300000 / 2);
+	sfree(reused);
+	sdecay_stop();
+	sdecay_stop();
+	sfree(guard);
+}
+
+void test_pool_and_allocator() {
+	size_t blocks = _num_allocated_blocks();
+	{
+		SPool<long> pool(100);
+		long *first = pool.create(1);
+		assert(_num_allocated_blocks() == blocks + 1);
+		long *objects[199];
+		for (int i = 0; i < 199; ++i)
+			objects[i] = pool.create(i);
+		assert(_num_allocated_blocks() == blocks + 2);
+		pool.destroy(objects[50]);
+		assert(pool.create(7) == objects[50]);
+		assert(*first == 1);
+	}
+	assert(_num_free_blocks() == _num_allocated_blocks()); // the chunks went back with the pool
+	{
+		std::map<int, int, std::less<int>, SAllocator<std::pair<const int, int>>> map;
+		for (int i = 0; i < 1000; ++i)
+			map[i] = i;
+		std::vector<int, SAllocator<int>> vector(map.size());
+		assert(_num_allocated_blocks() - _num_free_blocks() == 1001); // every node and the vector
+		std::map<int, int, std::less<int>, SAllocator<std::pair<const int, int>>> moved(std::move(map));
+		assert(moved.size() == 1000 and moved[999] == 999);
+		assert(SAllocator<int>() == SAllocator<long>());
+	}
+	assert(_num_free_blocks() == _num_allocated_blocks());
+}
+
+void test_usable_size() {
+	char *small = static_cast<char*>(smalloc(10));
+	assert(smalloc_usable_size(small) == 16);
+	char *big = static_cast<char*>(smalloc(200000));
+	assert(smalloc_usable_size(big) >= 200000);
+	assert(smalloc_usable_size(big + 100000) >= 100000);
+	assert(smalloc_usable_size(NULL) == 0);
+	int on_stack = 0;
+	assert(smalloc_usable_size(&on_stack) == 0);
+	size_t blocks = _num_allocated_blocks();
+	sfree(&on_stack); // not from this heap, ignored
+	assert(_num_allocated_blocks() == blocks);
+	sbrk(4096); // a foreign sbrk starts a new stretch of heap
+	char *after_gap = static_cast<char*>(smalloc(1000));
+#ifndef MALLOC_RESERVED_HEAP
+	assert(after_gap > small + 4096);
+#else
+	assert(after_gap == small + 16 + _size_meta_data()); // unless the heap stays off the break
+#endif
+	assert(smalloc_usable_size(after_gap) == 1008);
+	sfree(big);
+	assert(smalloc_usable_size(big) == 0);
+	sfree(after_gap);
+	sfree(small);
+}
+
+void test_memalign_and_sized_free() {
+	for (size_t alignment = 1; alignment <= 4096; alignment *= 2) {
+		char *p = static_cast<char*>(smemalign(alignment, 100));
+		assert(p != NULL);
+		assert(reinterpret_cast<size_t>(p) % alignment == 0);
+		assert(reinterpret_cast<size_t>(p) % 16 == 0);
+		assert(smalloc_usable_size(p) >= 100);
+		memset(p, 1, 100);
+		sfree(p);
+	}
+	assert(smemalign(3, 100) == NULL);
+	assert(smemalign(8192, 100) == NULL);
+	// aligned blocks mixed with plain ones must not overlap
+	std::vector<char*> live;
+	std::vector<size_t> sizes;
+	srand(7);
+	for (int i = 0; i < 2000; ++i) {
+		if (!live.empty() && rand() % 3 == 0) {
+			size_t victim = rand() % live.size();
+			for (size_t j = 0; j < sizes[victim]; ++j) {
+				assert(live[victim][j] == (char)sizes[victim]);
+			}
+			sfree(live[victim]);
+			live[victim] = live.back();
+			sizes[victim] = sizes.back();
+			live.pop_back();
+			sizes.pop_back();
+			continue;
+		}
+		size_t size = 1 + rand() % 600;
+		size_t alignment = (size_t)16 << (rand() % 5);
+		char *p = static_cast<char*>(rand() % 2 ? smemalign(alignment, size) : smalloc(size));
+		assert(p != NULL);
+		memset(p, (char)size, size);
+		live.push_back(p);
+		sizes.push_back(size);
+	}
+	for (size_t i = 0; i < live.size(); ++i) {
+		sfree(live[i]);
+	}
+	assert(_num_free_blocks() == _num_allocated_blocks());
+	// sized frees skip the page map but land in the same place
+	char *small = static_cast<char*>(smalloc(100));
+	size_t free_blocks = _num_free_blocks();
+	sfree_sized(small, 100);
+	assert(_num_free_blocks() == free_blocks + 1);
+	assert(smalloc(100) == small);
+	char *pages = static_cast<char*>(smalloc(6000));
+	size_t used = _num_allocated_blocks() - _num_free_blocks();
+	sfree_sized(pages, 6000);
+	assert(_num_allocated_blocks() - _num_free_blocks() == used - 1);
+	sfree_sized(NULL, 100);
+}
+
+static const STelemetry *telemetry_page() {
+	char name[32];
+	stelemetry_name(name, sizeof(name), getpid());
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	void *page = mmap(NULL, sizeof(STelemetry), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return page == MAP_FAILED ? NULL : static_cast<const STelemetry*>(page);
+}
+
+static void check_telemetry(const STelemetry *page) {
+	assert(stelemetry_allocated_blocks(page) == _num_allocated_blocks());
+	assert(stelemetry_allocated_bytes(page) == _num_allocated_bytes());
+	assert(stelemetry_free_blocks(page) == _num_free_blocks());
+	assert(stelemetry_free_bytes(page) == _num_free_bytes());
+	assert(stelemetry_meta_data_bytes(page) == _num_meta_data_bytes());
+}
+
+void test_telemetry() {
+	void *early = smalloc(1000); // counted before the page exists
+	assert(telemetry_page() == NULL);
+	assert(stelemetry_start());
+	assert(not stelemetry_start());
+	const STelemetry *page = telemetry_page();
+	assert(page != NULL);
+	assert(page->magic == STELEMETRY_MAGIC);
+	assert(page->pid == (uint64_t)getpid());
+	assert(page->smalloc_calls == 1);
+	check_telemetry(page);
+	std::vector<void*> live;
+	srand(3);
+	for (int i = 0; i < 3000; ++i) {
+		int action = rand() % 8;
+		if (!live.empty() && action < 3) {
+			size_t victim = rand() % live.size();
+			sfree(live[victim]);
+			live[victim] = live.back();
+			live.pop_back();
+		} else if (!live.empty() && action == 3) {
+			size_t victim = rand() % live.size();
+			live[victim] = srealloc(live[victim], 1 + rand() % 8000);
+		} else if (action == 4) {
+			live.push_back(smemalign(64, 1 + rand() % 500));
+		} else if (action == 5 && rand() % 10 == 0) {
+			live.push_back(smalloc(200000));
+		} else {
+			live.push_back(smalloc(1 + rand() % (rand() % 2 ? 128 : 6000)));
+		}
+	}
+	sfree(smalloc(64));
+	assert(page->mmap_blocks > 0 && page->page_runs > 0 && page->fast_bin_blocks > 0);
+	void *batch[16];
+	assert(smalloc_batch(300, 16, batch) == 16);
+	check_telemetry(page);
+#ifndef MALLOC_RESERVED_HEAP
+	assert(page->sbrk_calls > 0);
+#else
+	assert(page->sbrk_calls == 0 && page->mprotect_calls > 0);
+#endif
+	assert(page->mmap_calls > 0 && page->munmap_calls > 0);
+	sfree_batch(batch, 16);
+	for (size_t i = 0; i < live.size(); ++i)
+		sfree(live[i]);
+	check_telemetry(page);
+	// a forked child counts on a copy of its own
+	uint64_t calls = page->smalloc_calls;
+	if (!fork()) {
+		sfree(smalloc(100));
+		exit(page->smalloc_calls == calls ? 0 : 1);
+	}
+	int exit_status = 0;
+	wait(&exit_status);
+	assert(exit_status == 0);
+	stelemetry_stop();
+	stelemetry_stop();
+	assert(telemetry_page() == NULL);
+	sfree(early);
+	assert(stelemetry_start()); // the counters carried on while stopped
+	page = telemetry_page();
+	check_telemetry(page);
+	stelemetry_stop();
+}
+
+static void *inline_worker(void *) {
+	void *blocks[100];
+	for (int i = 0; i < 100; ++i) {
+		blocks[i] = smalloc_inline(40);
+	}
+	for (int i = 0; i < 100; ++i) {
+		sfree_inline(blocks[i], 40);
+	}
+	return NULL; // the thread exit flushes its lists
+}
+
+void test_inline_cache() {
+	size_t used = _num_allocated_blocks() - _num_free_blocks();
+	char *first = static_cast<char*>(smalloc_inline(100));
+	assert(reinterpret_cast<size_t>(first) % 16 == 0);
+	assert(smalloc_usable_size(first) == 112);
+	// the miss took a whole batch, the hits walk through it in address order
+	char *second = static_cast<char*>(smalloc_inline(97));
+	assert(second == first + 112 + _size_meta_data());
+	memset(first, 1, 112);
+	memset(second, 2, 112);
+	sfree_inline(second, 97);
+	assert(smalloc_inline(112) == second);
+	sfree_inline(second, 112);
+	sfree_inline(first, 100);
+	// cached blocks stay allocated until the flush
+	assert(_num_allocated_blocks() - _num_free_blocks() > used);
+	sinline_flush();
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	// a full list hands half of itself back
+	std::vector<void*> blocks;
+	for (int i = 0; i < 200; ++i) {
+		blocks.push_back(smalloc_inline(16));
+	}
+	for (void *block : blocks) {
+		sfree_inline(block, 16);
+	}
+	assert(_num_allocated_blocks() - _num_free_blocks() <= used + SINLINE_MAX_COUNT);
+	sinline_flush();
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	// sizes outside the classes go through to smalloc and sfree_sized
+	assert(smalloc_inline(0) == NULL);
+	void *big = smalloc_inline(5000);
+	assert(smalloc_usable_size(big) >= 5000);
+	sfree_inline(big, 5000);
+	sfree_inline(NULL, 16);
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, inline_worker, NULL) == 0);
+	pthread_join(thread, NULL);
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+}
+
+#define CPU_CACHE_THREADS 4
+
+static void *cpu_cache_worker(void *arg) {
+	unsigned seed = static_cast<unsigned>(reinterpret_cast<long>(arg));
+	unsigned char *blocks[64] = {};
+	size_t sizes[64] = {};
+	for (int i = 0; i < 20000; ++i) {
+		int slot = rand_r(&seed) % 64;
+		for (size_t byte = 0; byte < sizes[slot]; ++byte) {
+			assert(blocks[slot][byte] == static_cast<unsigned char>(slot));
+		}
+		sfree(blocks[slot]);
+		sizes[slot] = 1 + rand_r(&seed) % 300;
+		blocks[slot] = static_cast<unsigned char*>(smalloc(sizes[slot]));
+		memset(blocks[slot], slot, sizes[slot]);
+	}
+	for (int slot = 0; slot < 64; ++slot) {
+		sfree_sized(blocks[slot], sizes[slot]);
+	}
+	return NULL;
+}
+
+void test_cpu_cache() {
+	size_t used = _num_allocated_blocks() - _num_free_blocks();
+	assert(scpu_cache_start());
+	assert(not scpu_cache_start());
+	// a miss refills the class in one batch, the hits walk through it in address order
+	char *first = static_cast<char*>(smalloc(100));
+	char *second = static_cast<char*>(smalloc(100));
+	assert(second == first + 112 + _size_meta_data());
+	sfree(second);
+	assert(smalloc(112) == second);
+	sfree(second);
+	sfree_sized(first, 100);
+	// cached blocks stay allocated until the stop
+	assert(_num_allocated_blocks() - _num_free_blocks() > used);
+	void *big = smalloc(1000);
+	assert(smalloc_usable_size(big) == 1008);
+	sfree(big);
+	pthread_t threads[CPU_CACHE_THREADS];
+	for (long i = 0; i < CPU_CACHE_THREADS; ++i) {
+		assert(pthread_create(&threads[i], NULL, cpu_cache_worker, reinterpret_cast<void*>(i + 1)) == 0);
+	}
+	for (int i = 0; i < CPU_CACHE_THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	scpu_cache_stop();
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	// stopped, blocks go straight back to the heap
+	sfree(smalloc(100));
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+	assert(scpu_cache_start());
+	sfree(smalloc(50));
+	scpu_cache_stop();
+	assert(_num_allocated_blocks() - _num_free_blocks() == used);
+}
+
+void test_handles() {
+	// handle blocks with ordinary blocks between them, which are then freed
+	SHandle handles[50];
+	void *gaps[50];
+	void *first_addresses[50];
+	for (int i = 0; i < 50; ++i) {
+		handles[i] = shandle_alloc(1000);
+		gaps[i] = smalloc(1000);
+		first_addresses[i] = shandle_pin(handles[i]);
+		memset(first_addresses[i], i, 1000);
+		shandle_unpin(handles[i]);
+	}
+	for (int i = 0; i < 50; ++i) {
+		sfree(gaps[i]);
+	}
+	assert(_num_free_blocks() == 50);
+#ifndef MALLOC_RESERVED_HEAP
+	void *program_break = sbrk(0);
+#endif
+	// a pinned block stays put and keeps the free space in front of it
+	void *pinned = shandle_pin(handles[10]);
+	size_t trimmed = scompact();
+	assert(trimmed >= 39 * (1000 + _size_meta_data()));
+	assert(_num_free_blocks() == 2);
+#ifndef MALLOC_RESERVED_HEAP
+	assert(sbrk(0) == static_cast<char*>(program_break) - trimmed);
+#endif
+	assert(shandle_pin(handles[10]) == pinned);
+	shandle_unpin(handles[10]);
+	shandle_unpin(handles[10]);
+	for (int i = 0; i < 50; ++i) {
+		char *block = static_cast<char*>(shandle_pin(handles[i]));
+		assert(block[0] == (char)i && block[999] == (char)i);
+		assert((block == first_addresses[i]) == (i == 0 || i == 10));
+		shandle_unpin(handles[i]);
+	}
+	// the blocks slid down next to each other
+	char *second = static_cast<char*>(shandle_pin(handles[2]));
+	assert(second == static_cast<char*>(shandle_pin(handles[1])) + 1008 + _size_meta_data());
+	shandle_unpin(handles[1]);
+	shandle_unpin(handles[2]);
+	// a run from the page heap does not move
+	SHandle pages = shandle_alloc(10000);
+	void *run = shandle_pin(pages);
+	memset(run, 7, 10000);
+	shandle_unpin(pages);
+	for (int i = 0; i < 50; ++i) {
+		shandle_free(handles[i]);
+	}
+	scompact();
+	assert(shandle_pin(pages) == run);
+	shandle_unpin(pages);
+	shandle_free(pages);
+	assert(_num_free_blocks() == _num_allocated_blocks());
+	assert(shandle_alloc(0) == nullptr);
+}
+
+#ifdef MALLOC_RESERVED_HEAP
+void test_reserved_heap() {
+	char *first = static_cast<char*>(smalloc(1000));
+	void *program_break = sbrk(4096);
+	assert(program_break != (void *)(-1));
+	char *second = static_cast<char*>(smalloc(1000));
+	assert(second == first + 1008 + _size_meta_data());
+	assert(sbrk(0) == static_cast<char*>(program_break) + 4096); // the break is left alone
+	// the tail grows in place across the foreign sbrk
+	sfree(second);
+	char *grown = static_cast<char*>(smalloc(3000));
+	assert(grown == second);
+	char *third = static_cast<char*>(smalloc(3000));
+	assert(third == grown + 3008 + _size_meta_data());
+	memset(grown, 3, 3000);
+	memset(third, 3, 3000);
+	sfree(grown);
+	sfree(third);
+	sfree(first);
+	assert(_num_free_blocks() == 1);
+	assert(_num_allocated_blocks() == 1);
+	// and gives back the pages it no longer needs
+	assert(sdecay_start(100));
+	usleep(300 * 1000);
+	assert(sdecay_purged_bytes() > 0);
+	sdecay_stop();
+	char *again = static_cast<char*>(smalloc(3000));
+	memset(again, 4, 3000);
+	assert(again == first);
+	sfree(again);
+}
+#endif
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static int failures = 0;
+
+static void callTestFunction(void (*func)()) {
+	if (!fork()) {  // test as son, to get a clear heap
+		func();
+		exit(0);
+	} else {		// father waits for son before continuing to next test
+		int exit_status = 0;
+		wait(&exit_status);
+		if (!exit_status)
+			return;
+		++failures;
+		if (WIFEXITED(exit_status) && WEXITSTATUS(exit_status))
+			std::cout << "Exit status ERROR " << WEXITSTATUS(exit_status) << ". ";
+		if (WIFSIGNALED(exit_status))
+			std::cout << "Error signal " << WTERMSIG(exit_status);
+		std::cout << std::endl;
+	}
+}
+
+int main()
+{
+	std::cout << "test_region_alloc_and_destroy" << std::endl;
+	callTestFunction(test_region_alloc_and_destroy);
+	std::cout << "test_region_reset_and_oversized" << std::endl;
+	callTestFunction(test_region_reset_and_oversized);
+	std::cout << "test_batch_alloc_and_free" << std::endl;
+	callTestFunction(test_batch_alloc_and_free);
+	std::cout << "test_fast_bins_reuse_and_consolidate" << std::endl;
+	callTestFunction(test_fast_bins_reuse_and_consolidate);
+	std::cout << "test_cross_thread_frees" << std::endl;
+	callTestFunction(test_cross_thread_frees);
+	std::cout << "test_heap_walk" << std::endl;
+	callTestFunction(test_heap_walk);
+	std::cout << "test_heap_profile" << std::endl;
+	callTestFunction(test_heap_profile);
+	std::cout << "test_heap_profile_batch_free" << std::endl;
+	callTestFunction(test_heap_profile_batch_free);
+	std::cout << "test_heap_profile_failed_realloc" << std::endl;
+	callTestFunction(test_heap_profile_failed_realloc);
+	std::cout << "test_usable_size" << std::endl;
+	callTestFunction(test_usable_size);
+	std::cout << "test_page_heap" << std::endl;
+	callTestFunction(test_page_heap);
+	std::cout << "test_decay" << std::endl;
+	callTestFunction(test_decay);
+	std::cout << "test_pool_and_allocator" << std::endl;
+	callTestFunction(test_pool_and_allocator);
+	std::cout << "test_memalign_and_sized_free" << std::endl;
+	callTestFunction(test_memalign_and_sized_free);
+	std::cout << "test_telemetry" << std::endl;
+	callTestFunction(test_telemetry);
+	std::cout << "test_inline_cache" << std::endl;
+	callTestFunction(test_inline_cache);
+	std::cout << "test_cpu_cache" << std::endl;
+	callTestFunction(test_cpu_cache);
+	std::cout << "test_handles" << std::endl;
+	callTestFunction(test_handles);
+#ifdef MALLOC_RESERVED_HEAP
+	std::cout << "test_reserved_heap" << std::endl;
+	callTestFunction(test_reserved_heap);
+#endif
+	std::cout << "Done." << std::endl;
+	return failures != 0;
+}
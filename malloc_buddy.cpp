@@ -0,0 +1,331 @@
+/*
+Binary buddy allocator with the smalloc API. The heap grows in arenas of
+2^ARENA_ORDER bytes taken with sbrk and aligned to their size, and every
+block is a power of two (header included) at an offset that is a multiple
+of its size. A block's buddy is found by flipping one address bit, so
+splitting and coalescing are O(log n) with no neighbour lists. Requests of
+MMAP_MIN_SIZE and above get their own mapping as in malloc_3.
+
+Compared with the split/merge heap of malloc_3/malloc_4 (split_block /
+merge_free), a block wastes up to half its size to rounding, but free
+blocks can only merge into the fixed set of buddy ranges, so the free
+space never breaks into more pieces than there are orders.
+ */
+
+#include <cstring>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "malloc_3.h"
+
+using std::memset;
+using std::memmove;
+
+#define MMAP_MIN_SIZE (128 * 1024)
+#define MAX_SIZE 100000000
+#define MIN_ORDER 6
+#define ARENA_ORDER 20
+#define ARENA_SIZE ((size_t)1 << ARENA_ORDER)
+#define MAX_ARENAS 4096
+#define MMAP_ORDER 0
+
+struct MallocMetadata{
+    size_t size;
+    bool is_free;
+    unsigned char order;
+    MallocMetadata* next_free;  // mmap blocks are never free and use these for the mmap list
+    MallocMetadata* prev_free;
+};
+
+static char* arenas[MAX_ARENAS];
+static size_t arena_count = 0;
+static MallocMetadata* free_lists[ARENA_ORDER + 1] = {nullptr};
+static MallocMetadata* mmap_list_block_head = nullptr;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t aligned_size(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// smallest order whose block holds size bytes after the header
+static int order_of(size_t size) {
+    size_t total = size + _size_meta_data();
+    int order = MIN_ORDER;
+    while (((size_t)1 << order) < total) {
+        ++order;
+    }
+    return order;
+}
+
+static MallocMetadata* buddy_of(MallocMetadata* block) {
+    return (MallocMetadata*)((uintptr_t)block ^ ((uintptr_t)1 << block->order));
+}
+
+static void set_order(MallocMetadata* block, int order) {
+    block->order = order;
+    block->size = ((size_t)1 << order) - _size_meta_data();
+}
+
+static void free_list_insert(MallocMetadata* block) {
+    block->is_free = true;
+    block->prev_free = nullptr;
+    block->next_free = free_lists[block->order];
+    if (block->next_free != nullptr) {
+        block->next_free->prev_free = block;
+    }
+    free_lists[block->order] = block;
+}
+
+static void free_list_remove(MallocMetadata* block) {
+    if (block->prev_free != nullptr) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[block->order] = block->next_free;
+    }
+    if (block->next_free != nullptr) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    block->is_free = false;
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+}
+
+// halves block until it is of the given order, freeing the upper halves
+static void split_block(MallocMetadata* block, int order) {
+    while (block->order > order) {
+        set_order(block, block->order - 1);
+        MallocMetadata* upper = buddy_of(block);
+        set_order(upper, block->order);
+        free_list_insert(upper);
+    }
+}
+
+static MallocMetadata* arena_create() {
+    if (arena_count == MAX_ARENAS) {
+        return nullptr;
+    }
+    uintptr_t prog_break = (uintptr_t)sbrk(0);
+    size_t padding = (ARENA_SIZE - prog_break % ARENA_SIZE) % ARENA_SIZE;
+    if (sbrk(padding + ARENA_SIZE) == (void*)(-1)) {
+        return nullptr;
+    }
+    char* arena = (char*)(prog_break + padding);
+    arenas[arena_count++] = arena;
+    MallocMetadata* block = (MallocMetadata*)arena;
+    set_order(block, ARENA_ORDER);
+    block->is_free = false;
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+    return block;
+}
+
+static void* mmap_create(size_t size) {
+    void* new_mmap = mmap(NULL, size + _size_meta_data(), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (new_mmap == (void*)(-1)) {
+        return NULL;
+    }
+    MallocMetadata* block = (MallocMetadata*)new_mmap;
+    block->size = size;
+    block->is_free = false;
+    block->order = MMAP_ORDER;
+    block->prev_free = nullptr;
+    block->next_free = mmap_list_block_head;
+    if (mmap_list_block_head != nullptr) {
+        mmap_list_block_head->prev_free = block;
+    }
+    mmap_list_block_head = block;
+    return block + 1;
+}
+
+static void mmap_destroy(MallocMetadata* block) {
+    if (block->prev_free != nullptr) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        mmap_list_block_head = block->next_free;
+    }
+    if (block->next_free != nullptr) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    munmap(block, block->size + _size_meta_data());
+}
+
+static void* smalloc_unlocked(size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (size_aligned >= MMAP_MIN_SIZE) {
+        return mmap_create(size_aligned);
+    }
+    int order = order_of(size_aligned);
+    int available = order;
+    while (available <= ARENA_ORDER and free_lists[available] == nullptr) {
+        ++available;
+    }
+    MallocMetadata* block;
+    if (available <= ARENA_ORDER) {
+        block = free_lists[available];
+        free_list_remove(block);
+    } else {
+        block = arena_create();
+        if (block == nullptr) {
+            return NULL;
+        }
+    }
+    split_block(block, order);
+    return block + 1;
+}
+
+static void sfree_unlocked(void* p) {
+    if (p == NULL) {
+        return;
+    }
+    MallocMetadata* block = (MallocMetadata*)p - 1;
+    if (block->order == MMAP_ORDER) {
+        mmap_destroy(block);
+        return;
+    }
+    while (block->order < ARENA_ORDER) {
+        MallocMetadata* buddy = buddy_of(block);
+        if (not buddy->is_free or buddy->order != block->order) {
+            break;
+        }
+        free_list_remove(buddy);
+        if (buddy < block) {
+            block = buddy;
+        }
+        set_order(block, block->order + 1);
+    }
+    free_list_insert(block);
+}
+
+static void* srealloc_unlocked(void* oldp, size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (oldp == NULL) {
+        return smalloc_unlocked(size_aligned);
+    }
+    MallocMetadata* block = (MallocMetadata*)oldp - 1;
+    size_t old_size = block->size;
+    if (block->order != MMAP_ORDER and size_aligned < MMAP_MIN_SIZE) {
+        int order = order_of(size_aligned);
+        // grow in place while the block is the lower half and its upper buddy is wholly free
+        while (block->order < order) {
+            MallocMetadata* buddy = buddy_of(block);
+            if (buddy < block or not buddy->is_free or buddy->order != block->order) {
+                break;
+            }
+            free_list_remove(buddy);
+            set_order(block, block->order + 1);
+        }
+        if (block->order >= order) {
+            split_block(block, order);
+            return oldp;
+        }
+    } else if (block->order == MMAP_ORDER and old_size == size_aligned) {
+        return oldp;
+    }
+    void* new_block = smalloc_unlocked(size_aligned);
+    if (new_block != NULL) {
+        memmove(new_block, oldp, size_aligned < old_size ? size_aligned : old_size);
+        sfree_unlocked(oldp);
+    }
+    return new_block;
+}
+
+void* smalloc(size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    void* address = smalloc_unlocked(size);
+    pthread_mutex_unlock(&heap_lock);
+    return address;
+}
+
+void* scalloc(size_t num, size_t size) {
+    if (size == 0 or num == 0 or num > MAX_SIZE / size) {
+        return NULL;
+    }
+    void* address = smalloc(num * size);
+    if (address != NULL) {
+        memset(address, 0, num * size);
+    }
+    return address;
+}
+
+void sfree(void* p) {
+    pthread_mutex_lock(&heap_lock);
+    sfree_unlocked(p);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    void* address = srealloc_unlocked(oldp, size);
+    pthread_mutex_unlock(&heap_lock);
+    return address;
+}
+
+// walks every block of every arena, then the mmap list; the caller holds heap_lock
+static void count_blocks(bool only_free, size_t* blocks, size_t* bytes) {
+    *blocks = 0;
+    *bytes = 0;
+    for (size_t i = 0; i < arena_count; ++i) {
+        for (char* p = arenas[i]; p < arenas[i] + ARENA_SIZE; p += (size_t)1 << ((MallocMetadata*)p)->order) {
+            MallocMetadata* block = (MallocMetadata*)p;
+            if (not only_free or block->is_free) {
+                ++*blocks;
+                *bytes += block->size;
+            }
+        }
+    }
+    if (only_free) {
+        return;
+    }
+    for (MallocMetadata* tmp = mmap_list_block_head; tmp != nullptr; tmp = tmp->next_free) {
+        ++*blocks;
+        *bytes += tmp->size;
+    }
+}
+
+size_t _num_free_blocks() {
+    size_t blocks, bytes;
+    pthread_mutex_lock(&heap_lock);
+    count_blocks(true, &blocks, &bytes);
+    pthread_mutex_unlock(&heap_lock);
+    return blocks;
+}
+
+size_t _num_free_bytes() {
+    size_t blocks, bytes;
+    pthread_mutex_lock(&heap_lock);
+    count_blocks(true, &blocks, &bytes);
+    pthread_mutex_unlock(&heap_lock);
+    return bytes;
+}
+
+size_t _num_allocated_blocks() {
+    size_t blocks, bytes;
+    pthread_mutex_lock(&heap_lock);
+    count_blocks(false, &blocks, &bytes);
+    pthread_mutex_unlock(&heap_lock);
+    return blocks;
+}
+
+size_t _num_allocated_bytes() {
+    size_t blocks, bytes;
+    pthread_mutex_lock(&heap_lock);
+    count_blocks(false, &blocks, &bytes);
+    pthread_mutex_unlock(&heap_lock);
+    return bytes;
+}
+
+size_t _num_meta_data_bytes() {
+    return _num_allocated_blocks() * _size_meta_data();
+}
+
+size_t _size_meta_data() {
+    return sizeof(MallocMetadata);
+}
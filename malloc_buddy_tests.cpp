@@ -0,0 +1,179 @@
+/*
+Tests for the binary buddy backend (malloc_buddy.cpp).
+Every test runs in a forked child so it starts from a clean heap.
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <iostream>
+#include "malloc_3.h"
+
+#define ARENA_SIZE (1 << 20)
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_power_of_two_blocks() {
+	assert(smalloc(0) == NULL);
+	assert(smalloc(100000001) == NULL);
+	char *a = static_cast<char*>(smalloc(10));
+	char *b = static_cast<char*>(smalloc(100));
+	assert(a != NULL and b != NULL);
+	assert(reinterpret_cast<size_t>(a) % 8 == 0 and reinterpret_cast<size_t>(b) % 8 == 0);
+	size_t meta = _size_meta_data();
+	// both blocks sit at the start of an arena aligned to its size
+	assert((reinterpret_cast<size_t>(a) - meta) % ARENA_SIZE == 0);
+	assert(_num_allocated_bytes() + _num_meta_data_bytes() == ARENA_SIZE);
+	assert(_num_allocated_blocks() - _num_free_blocks() == 2);
+	assert(static_cast<size_t>(b - a) == 256);
+	sfree(b);
+	sfree(a);
+	assert(_num_allocated_blocks() == 1);
+	assert(_num_free_blocks() == 1);
+	assert(_num_free_bytes() == ARENA_SIZE - meta);
+}
+
+void test_buddies_coalesce() {
+	char *blocks[4];
+	for (int i = 0; i < 4; ++i)
+		blocks[i] = static_cast<char*>(smalloc(900));
+	for (int i = 1; i < 4; ++i)
+		assert(blocks[i] - blocks[i - 1] == 1024);
+	size_t free_blocks = _num_free_blocks();
+	sfree(blocks[1]);
+	sfree(blocks[2]);
+	// 1 and 2 are not buddies, so neither merges
+	assert(_num_free_blocks() == free_blocks + 2);
+	sfree(blocks[0]);
+	assert(_num_free_blocks() == free_blocks + 2);
+	sfree(blocks[3]);
+	assert(_num_free_blocks() == 1);
+	assert(smalloc(3000) == blocks[0]);
+}
+
+void test_realloc() {
+	char *a = static_cast<char*>(smalloc(100));
+	memset(a, 'x', 100);
+	char *grown = static_cast<char*>(srealloc(a, 900));
+	assert(grown == a);
+	assert(grown[99] == 'x');
+	char *shrunk = static_cast<char*>(srealloc(grown, 16));
+	assert(shrunk == a);
+	char *b = static_cast<char*>(smalloc(16));
+	assert(b - shrunk == 64);
+	char *moved = static_cast<char*>(srealloc(shrunk, 100));
+	assert(moved != shrunk);
+	assert(moved[0] == 'x');
+	char *big = static_cast<char*>(srealloc(moved, 200000));
+	assert(big != NULL and big[0] == 'x');
+	sfree(big);
+	sfree(b);
+	assert(_num_free_blocks() == 1);
+}
+
+void test_mmap_blocks() {
+	size_t blocks = _num_allocated_blocks();
+	char *big = static_cast<char*>(smalloc(200000));
+	assert(big != NULL);
+	memset(big, 1, 200000);
+	assert(_num_allocated_blocks() == blocks + 1);
+	assert(_num_allocated_bytes() >= 200000);
+	char *zeroed = static_cast<char*>(scalloc(1000, 200));
+	assert(zeroed != NULL and zeroed[199999] == 0);
+	sfree(big);
+	sfree(zeroed);
+	assert(_num_allocated_blocks() == blocks);
+}
+
+void test_wrapping_sizes() {
+	// rounding these up to a multiple of 8 wraps around to 0
+	char *p = static_cast<char*>(smalloc(100));
+	memset(p, 'z', 100);
+	size_t blocks = _num_allocated_blocks();
+	size_t free_blocks = _num_free_blocks();
+	assert(smalloc((size_t)-1) == NULL);
+	assert(smalloc((size_t)-7) == NULL);
+	assert(srealloc(NULL, (size_t)-1) == NULL);
+	assert(srealloc(p, (size_t)-3) == NULL);
+	assert(p[99] == 'z');
+	assert(_num_allocated_blocks() == blocks);
+	assert(_num_free_blocks() == free_blocks);
+	sfree(p);
+}
+
+void test_random_workload() {
+	const int SLOTS = 512;
+	char *slots[SLOTS] = {NULL};
+	size_t sizes[SLOTS] = {0};
+	srand(7);
+	for (int i = 0; i < 100000; ++i) {
+		int slot = rand() % SLOTS;
+		if (slots[slot] != NULL) {
+			for (size_t j = 0; j < sizes[slot]; j += 97)
+				assert(slots[slot][j] == static_cast<char>(slot));
+		}
+		size_t size = 1 + rand() % (rand() % 16 ? 2000 : 150000);
+		if (slots[slot] == NULL) {
+			slots[slot] = static_cast<char*>(smalloc(size));
+		} else if (rand() % 2) {
+			slots[slot] = static_cast<char*>(srealloc(slots[slot], size));
+		} else {
+			sfree(slots[slot]);
+			slots[slot] = NULL;
+			continue;
+		}
+		assert(slots[slot] != NULL);
+		sizes[slot] = size;
+		memset(slots[slot], slot, size);
+	}
+	for (int i = 0; i < SLOTS; ++i)
+		sfree(slots[i]);
+	// every arena coalesces back into a single free block
+	assert(_num_free_blocks() == _num_allocated_blocks());
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static int failures = 0;
+
+static void callTestFunction(void (*func)()) {
+	if (!fork()) {  // test as son, to get a clear heap
+		func();
+		exit(0);
+	} else {		// father waits for son before continuing to next test
+		int exit_status = 0;
+		wait(&exit_status);
+		if (!exit_status)
+			return;
+		++failures;
+		if (WIFEXITED(exit_status) && WEXITSTATUS(exit_status))
+			std::cout << "Exit status ERROR " << WEXITSTATUS(exit_status) << ". ";
+		if (WIFSIGNALED(exit_status))
+			std::cout << "Error signal " << WTERMSIG(exit_status);
+		std::cout << std::endl;
+	}
+}
+
+int main()
+{
+	std::cout << "test_power_of_two_blocks" << std::endl;
+	callTestFunction(test_power_of_two_blocks);
+	std::cout << "test_buddies_coalesce" << std::endl;
+	callTestFunction(test_buddies_coalesce);
+	std::cout << "test_realloc" << std::endl;
+	callTestFunction(test_realloc);
+	std::cout << "test_mmap_blocks" << std::endl;
+	callTestFunction(test_mmap_blocks);
+	std::cout << "test_wrapping_sizes" << std::endl;
+	callTestFunction(test_wrapping_sizes);
+	std::cout << "test_random_workload" << std::endl;
+	callTestFunction(test_random_workload);
+	std::cout << "Done." << std::endl;
+	return failures != 0;
+}
@@ -0,0 +1,51 @@
+/*
+The libc allocator behind the smalloc API, so the benchmarks can be linked
+against it and compared with the malloc_N backends.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include "malloc_3.h"
+
+void* smalloc(size_t size) {
+    return malloc(size);
+}
+
+void* scalloc(size_t num, size_t size) {
+    return calloc(num, size);
+}
+
+void sfree(void* p) {
+    free(p);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    return realloc(oldp, size);
+}
+
+// libc only reports byte totals, so the block counts stay 0
+size_t _num_free_blocks() {
+    return 0;
+}
+
+size_t _num_free_bytes() {
+    return mallinfo2().fordblks;
+}
+
+size_t _num_allocated_blocks() {
+    return 0;
+}
+
+size_t _num_allocated_bytes() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.fordblks + info.hblkhd;
+}
+
+size_t _num_meta_data_bytes() {
+    return 0;
+}
+
+size_t _size_meta_data() {
+    return sizeof(size_t);
+}
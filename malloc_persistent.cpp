@@ -0,0 +1,363 @@
+/*
+Persistent heap: the split/merge heap of malloc_3/malloc_4 over a MAP_SHARED
+file, or over a shm / memfd object for a heap shared by several processes.
+The file starts with a PersistentHeader holding what the static globals
+hold there (list head and tail, bins, the break), and every block starts with
+a PersistentBlock whose links are offsets from the start of the file, 0 being
+none. The break grows inside the capacity chosen at creation, so the mapping
+never has to move while the heap is open.
+ */
+
+#include "malloc_persistent.h"
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <cerrno>
+
+using std::memset;
+
+#define PERSISTENT_MAGIC 0x53504552534953ULL
+#define PERSISTENT_VERSION 1
+#define MAX_SIZE 100000000
+#define BIN_MAX_SIZE 128
+#define MIN_SPLIT 128
+#define KB 1024
+
+struct PersistentBlock {
+    uint64_t size;
+    uint64_t is_free;
+    uint64_t next;
+    uint64_t prev;
+    uint64_t next_free;
+    uint64_t prev_free;
+};
+
+struct SPersistentHeap {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t capacity;
+    uint64_t brk;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t root;
+    uint64_t bins[BIN_MAX_SIZE];
+    pthread_mutex_t lock; // process-shared and robust
+};
+
+static void lock_init(SPersistentHeap* heap) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&heap->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+static void heap_lock(SPersistentHeap* heap) {
+    if (pthread_mutex_lock(&heap->lock) == EOWNERDEAD) { // the holder died, take the heap as it is
+        pthread_mutex_consistent(&heap->lock);
+    }
+}
+
+static size_t aligned_size(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+static size_t heap_start() {
+    return aligned_size(sizeof(SPersistentHeap));
+}
+
+static PersistentBlock* block_at(SPersistentHeap* heap, uint64_t offset) {
+    return offset == 0 ? nullptr : (PersistentBlock*)((char*)heap + offset);
+}
+
+static uint64_t offset_of(SPersistentHeap* heap, PersistentBlock* block) {
+    return block == nullptr ? 0 : (char*)block - (char*)heap;
+}
+
+static size_t bin_index(size_t size) {
+    size_t index = size / KB;
+    return index < BIN_MAX_SIZE ? index : BIN_MAX_SIZE - 1;
+}
+
+static void bin_insert(SPersistentHeap* heap, PersistentBlock* block) {
+    size_t index = bin_index(block->size);
+    block->prev_free = 0;
+    block->next_free = heap->bins[index];
+    if (heap->bins[index] != 0) {
+        block_at(heap, heap->bins[index])->prev_free = offset_of(heap, block);
+    }
+    heap->bins[index] = offset_of(heap, block);
+}
+
+static void bin_remove(SPersistentHeap* heap, PersistentBlock* block) {
+    if (block->prev_free != 0) {
+        block_at(heap, block->prev_free)->next_free = block->next_free;
+    } else {
+        heap->bins[bin_index(block->size)] = block->next_free;
+    }
+    if (block->next_free != 0) {
+        block_at(heap, block->next_free)->prev_free = block->prev_free;
+    }
+    block->next_free = 0;
+    block->prev_free = 0;
+}
+
+// absorbs second, the block right after first, once neither is in a bin
+static void merge(SPersistentHeap* heap, PersistentBlock* first, PersistentBlock* second) {
+    first->size += second->size + sizeof(PersistentBlock);
+    first->next = second->next;
+    if (second->next != 0) {
+        block_at(heap, second->next)->prev = offset_of(heap, first);
+    }
+    if (heap->tail == offset_of(heap, second)) {
+        heap->tail = offset_of(heap, first);
+    }
+}
+
+static void split_block(SPersistentHeap* heap, size_t size, PersistentBlock* block_to_split) {
+    if (block_to_split->size < MIN_SPLIT + size + sizeof(PersistentBlock)) {
+        return;
+    }
+    PersistentBlock* rest = (PersistentBlock*)((char*)(block_to_split + 1) + size);
+    rest->size = block_to_split->size - size - sizeof(PersistentBlock);
+    rest->is_free = 1;
+    rest->next = block_to_split->next;
+    rest->prev = offset_of(heap, block_to_split);
+    if (rest->next != 0) {
+        block_at(heap, rest->next)->prev = offset_of(heap, rest);
+    }
+    block_to_split->next = offset_of(heap, rest);
+    block_to_split->size = size;
+    if (heap->tail == offset_of(heap, block_to_split)) {
+        heap->tail = offset_of(heap, rest);
+    }
+    PersistentBlock* after = block_at(heap, rest->next);
+    if (after != nullptr and after->is_free) {
+        bin_remove(heap, after);
+        merge(heap, rest, after);
+    }
+    bin_insert(heap, rest);
+}
+
+static PersistentBlock* bins_take(SPersistentHeap* heap, size_t size) {
+    for (size_t index = bin_index(size); index < BIN_MAX_SIZE; index++) {
+        for (PersistentBlock* block = block_at(heap, heap->bins[index]); block != nullptr;
+             block = block_at(heap, block->next_free)) {
+            if (block->size >= size) {
+                bin_remove(heap, block);
+                block->is_free = 0;
+                split_block(heap, size, block);
+                return block;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// the persistent counterpart of sbrk, moving the break inside the mapped capacity
+static bool heap_grow(SPersistentHeap* heap, size_t increment) {
+    if (heap->capacity - heap->brk < increment) {
+        return false;
+    }
+    heap->brk += increment;
+    return true;
+}
+
+static PersistentBlock* heap_extend(SPersistentHeap* heap, size_t size) {
+    PersistentBlock* tail = block_at(heap, heap->tail);
+    if (tail != nullptr and tail->is_free) { // grow the wilderness
+        if (not heap_grow(heap, size - tail->size)) {
+            return nullptr;
+        }
+        bin_remove(heap, tail);
+        tail->is_free = 0;
+        tail->size = size;
+        return tail;
+    }
+    uint64_t offset = heap->brk;
+    if (not heap_grow(heap, size + sizeof(PersistentBlock))) {
+        return nullptr;
+    }
+    PersistentBlock* block = block_at(heap, offset);
+    block->size = size;
+    block->is_free = 0;
+    block->next = 0;
+    block->prev = heap->tail;
+    block->next_free = 0;
+    block->prev_free = 0;
+    if (tail != nullptr) {
+        tail->next = offset;
+    } else {
+        heap->head = offset;
+    }
+    heap->tail = offset;
+    return block;
+}
+
+// maps the heap in fd, formatting it first when the object is empty, and closes fd
+static SPersistentHeap* heap_map(int fd, size_t capacity, bool* created_out) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return NULL;
+    }
+    bool created = file_stat.st_size == 0;
+    if (created) {
+        capacity = aligned_size(capacity);
+        if (capacity < heap_start() + sizeof(PersistentBlock) or ftruncate(fd, capacity) != 0) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        SPersistentHeap stored;
+        if ((size_t)file_stat.st_size < sizeof(stored) or pread(fd, &stored, sizeof(stored), 0) != sizeof(stored) or
+            stored.magic != PERSISTENT_MAGIC or stored.version != PERSISTENT_VERSION or
+            stored.capacity != (uint64_t)file_stat.st_size) {
+            close(fd);
+            return NULL;
+        }
+        capacity = stored.capacity;
+    }
+    void* base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (base == (void*)(-1)) {
+        return NULL;
+    }
+    SPersistentHeap* heap = (SPersistentHeap*)base;
+    if (created) {
+        memset(heap, 0, sizeof(SPersistentHeap));
+        heap->version = PERSISTENT_VERSION;
+        heap->capacity = capacity;
+        heap->brk = heap_start();
+        lock_init(heap);
+        __atomic_store_n(&heap->magic, PERSISTENT_MAGIC, __ATOMIC_RELEASE); // formatted, others may attach
+    }
+    *created_out = created;
+    return heap;
+}
+
+SPersistentHeap* spersist_open(const char* path, size_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    // the lock is set up once, with the heap: another process may hold it right now,
+    // and one whose holder died is recovered by heap_lock
+    bool created;
+    return heap_map(fd, capacity, &created);
+}
+
+SPersistentHeap* sshared_create(const char* name, size_t capacity) {
+    int fd = name != NULL ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : memfd_create("smalloc_shared", 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    bool created;
+    SPersistentHeap* heap = heap_map(fd, capacity, &created);
+    if (heap == NULL and name != NULL) {
+        shm_unlink(name);
+    }
+    return heap;
+}
+
+SPersistentHeap* sshared_attach(const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    bool created; // an object the creator has not formatted yet fails with capacity 0
+    return heap_map(fd, 0, &created);
+}
+
+void* spersist_alloc(SPersistentHeap* heap, size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (heap == NULL or size_aligned == 0 or size_aligned > MAX_SIZE) { // sizes near SIZE_MAX wrap to 0
+        return NULL;
+    }
+    heap_lock(heap);
+    PersistentBlock* block = bins_take(heap, size_aligned);
+    if (block == nullptr) {
+        block = heap_extend(heap, size_aligned);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return block == nullptr ? NULL : block + 1;
+}
+
+void spersist_free(SPersistentHeap* heap, void* p) {
+    if (heap == NULL or p == NULL) {
+        return;
+    }
+    heap_lock(heap);
+    PersistentBlock* block = (PersistentBlock*)p - 1;
+    block->is_free = 1;
+    PersistentBlock* next = block_at(heap, block->next);
+    if (next != nullptr and next->is_free) {
+        bin_remove(heap, next);
+        merge(heap, block, next);
+    }
+    PersistentBlock* prev = block_at(heap, block->prev);
+    if (prev != nullptr and prev->is_free) {
+        bin_remove(heap, prev);
+        merge(heap, prev, block);
+        block = prev;
+    }
+    bin_insert(heap, block);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+void spersist_set_root(SPersistentHeap* heap, void* p) {
+    heap->root = p == NULL ? 0 : spersist_offset(heap, p);
+}
+
+void* spersist_root(SPersistentHeap* heap) {
+    return spersist_pointer(heap, heap->root);
+}
+
+size_t spersist_offset(SPersistentHeap* heap, const void* p) {
+    return (const char*)p - (const char*)heap;
+}
+
+void* spersist_pointer(SPersistentHeap* heap, size_t offset) {
+    return offset == 0 ? NULL : (char*)heap + offset;
+}
+
+size_t spersist_free_bytes(SPersistentHeap* heap) {
+    heap_lock(heap);
+    size_t num_of_free_bytes = 0;
+    for (PersistentBlock* block = block_at(heap, heap->head); block != nullptr; block = block_at(heap, block->next)) {
+        if (block->is_free) {
+            num_of_free_bytes += block->size;
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return num_of_free_bytes;
+}
+
+size_t spersist_allocated_blocks(SPersistentHeap* heap) {
+    heap_lock(heap);
+    size_t count_of_allocated_blocks = 0;
+    for (PersistentBlock* block = block_at(heap, heap->head); block != nullptr; block = block_at(heap, block->next)) {
+        ++count_of_allocated_blocks;
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return count_of_allocated_blocks;
+}
+
+int spersist_sync(SPersistentHeap* heap) {
+    heap_lock(heap);
+    int result = msync(heap, heap->capacity, MS_SYNC);
+    pthread_mutex_unlock(&heap->lock);
+    return result;
+}
+
+void spersist_close(SPersistentHeap* heap) {
+    if (heap == NULL) {
+        return;
+    }
+    munmap(heap, heap->capacity);
+}
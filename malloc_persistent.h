@@ -0,0 +1,50 @@
+#ifndef OS234123_HW4_MALLOC_PERSISTENT_H
+#define OS234123_HW4_MALLOC_PERSISTENT_H
+
+#include <cstddef>
+
+/* Persistent heap: a heap that lives in a file mapped with MAP_SHARED instead
+ * of on sbrk. Its blocks link to each other by offsets from the start of the
+ * file, so a later process that maps the same file resumes with every block
+ * intact. Pointers stored inside the heap should be kept as offsets too
+ * (spersist_offset / spersist_pointer), since the file may come back at
+ * another address. */
+struct SPersistentHeap;
+
+/* Maps path, creating a heap of capacity bytes if the file is empty or missing.
+ * An existing heap keeps its own capacity. Returns NULL if the file holds
+ * something else. Several processes may have the same file open at once. */
+SPersistentHeap* spersist_open(const char* path, size_t capacity) ;
+
+/* Shared heap: the same heap in a POSIX shared memory object that other
+ * processes attach to by name (remove it with shm_unlink), or with name NULL in
+ * a memfd that processes forked afterwards share. Blocks can be allocated in
+ * one process and read or freed in another. The lock is process-shared and
+ * robust, so a process dying inside a call does not block the others. */
+SPersistentHeap* sshared_create(const char* name, size_t capacity) ;
+
+SPersistentHeap* sshared_attach(const char* name) ;
+
+void* spersist_alloc(SPersistentHeap* heap, size_t size) ;
+
+void spersist_free(SPersistentHeap* heap, void* p) ;
+
+/* The entry point a restarted process finds its data from. */
+void spersist_set_root(SPersistentHeap* heap, void* p) ;
+
+void* spersist_root(SPersistentHeap* heap) ;
+
+size_t spersist_offset(SPersistentHeap* heap, const void* p) ;
+
+void* spersist_pointer(SPersistentHeap* heap, size_t offset) ;
+
+size_t spersist_free_bytes(SPersistentHeap* heap) ;
+
+size_t spersist_allocated_blocks(SPersistentHeap* heap) ;
+
+/* Flushes the file, returns 0 on success. */
+int spersist_sync(SPersistentHeap* heap) ;
+
+void spersist_close(SPersistentHeap* heap) ;
+
+#endif //OS234123_HW4_MALLOC_PERSISTENT_H
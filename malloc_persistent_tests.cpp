@@ -0,0 +1,270 @@
+/*
+Tests for the persistent heap (malloc_persistent.cpp).
+Every test runs in a forked child on a fresh heap file (the shared heap
+tests fork workers of their own).
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <iostream>
+#include "malloc_persistent.h"
+
+#define CAPACITY (4 * 1024 * 1024)
+
+static char heap_path[] = "/tmp/malloc_persistent_testXXXXXX";
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+struct Entry {
+	size_t next; // offset of the next entry, 0 at the end
+	int key;
+	char value[52];
+};
+
+void test_reopen_keeps_allocations() {
+	SPersistentHeap *heap = spersist_open(heap_path, CAPACITY);
+	assert(heap != NULL);
+	assert(spersist_root(heap) == NULL);
+	size_t head = 0;
+	for (int key = 0; key < 1000; ++key) {
+		Entry *entry = static_cast<Entry*>(spersist_alloc(heap, sizeof(Entry)));
+		assert(entry != NULL);
+		entry->next = head;
+		entry->key = key;
+		snprintf(entry->value, sizeof(entry->value), "value %d", key);
+		head = spersist_offset(heap, entry);
+	}
+	spersist_set_root(heap, spersist_pointer(heap, head));
+	size_t blocks = spersist_allocated_blocks(heap);
+	assert(spersist_sync(heap) == 0);
+	spersist_close(heap);
+
+	heap = spersist_open(heap_path, 0);
+	assert(heap != NULL);
+	assert(spersist_allocated_blocks(heap) == blocks);
+	int expected = 999;
+	for (Entry *entry = static_cast<Entry*>(spersist_root(heap)); entry != NULL;
+		 entry = static_cast<Entry*>(spersist_pointer(heap, entry->next))) {
+		char value[52];
+		snprintf(value, sizeof(value), "value %d", expected);
+		assert(entry->key == expected);
+		assert(strcmp(entry->value, value) == 0);
+		--expected;
+	}
+	assert(expected == -1);
+	// the heap goes on where it stopped
+	void *more = spersist_alloc(heap, 100);
+	assert(more != NULL);
+	assert(spersist_allocated_blocks(heap) == blocks + 1);
+	spersist_close(heap);
+}
+
+void test_free_merges_and_survives_reopen() {
+	SPersistentHeap *heap = spersist_open(heap_path, CAPACITY);
+	char *blocks[3];
+	for (int i = 0; i < 3; ++i)
+		blocks[i] = static_cast<char*>(spersist_alloc(heap, 1000));
+	void *guard = spersist_alloc(heap, 16);
+	spersist_free(heap, blocks[0]);
+	spersist_free(heap, blocks[2]);
+	spersist_free(heap, blocks[1]);
+	assert(spersist_allocated_blocks(heap) == 2);
+	size_t free_bytes = spersist_free_bytes(heap);
+	assert(free_bytes >= 3000);
+	size_t guard_offset = spersist_offset(heap, guard);
+	spersist_close(heap);
+
+	heap = spersist_open(heap_path, 0);
+	assert(spersist_free_bytes(heap) == free_bytes);
+	// the merged block is found in its bin after the reopen, and split again
+	char *reused = static_cast<char*>(spersist_alloc(heap, 500));
+	assert(spersist_offset(heap, reused) < guard_offset);
+	assert(spersist_allocated_blocks(heap) == 3);
+	spersist_free(heap, spersist_pointer(heap, guard_offset));
+	spersist_free(heap, reused);
+	assert(spersist_allocated_blocks(heap) == 1);
+	spersist_close(heap);
+}
+
+void test_capacity_and_bad_files() {
+	SPersistentHeap *heap = spersist_open(heap_path, 64 * 1024);
+	assert(heap != NULL);
+	assert(spersist_alloc(heap, 100 * 1024) == NULL);
+	assert(spersist_alloc(heap, 0) == NULL);
+	assert(spersist_alloc(heap, (size_t)-1) == NULL); // rounds up to 0
+	void *fits = spersist_alloc(heap, 32 * 1024);
+	assert(fits != NULL);
+	assert(spersist_alloc(heap, 32 * 1024) == NULL);
+	spersist_free(heap, fits);
+	assert(spersist_alloc(heap, 40 * 1024) != NULL); // the wilderness grows in place
+	spersist_close(heap);
+	FILE *file = fopen(heap_path, "r+");
+	fwrite("garbage", 1, 7, file);
+	fclose(file);
+	assert(spersist_open(heap_path, 0) == NULL);
+}
+
+void test_shared_between_processes() {
+	SPersistentHeap *heap = sshared_create(NULL, CAPACITY);
+	assert(heap != NULL);
+	const int WORKERS = 4, PER_WORKER = 500;
+	size_t *slots = static_cast<size_t*>(spersist_alloc(heap, WORKERS * PER_WORKER * sizeof(size_t)));
+	char *from_parent = static_cast<char*>(spersist_alloc(heap, 64));
+	strcpy(from_parent, "from the parent");
+	for (int worker = 0; worker < WORKERS; ++worker) {
+		if (fork() == 0) {
+			// churn alongside the other workers, then leave PER_WORKER tables behind
+			for (int i = 0; i < 2000; ++i) {
+				char *scratch = static_cast<char*>(spersist_alloc(heap, 16 + (i * 37) % 3000));
+				assert(scratch != NULL);
+				memset(scratch, worker, 16);
+				spersist_free(heap, scratch);
+			}
+			for (int i = 0; i < PER_WORKER; ++i) {
+				int *table = static_cast<int*>(spersist_alloc(heap, 64 * sizeof(int)));
+				assert(table != NULL);
+				for (int j = 0; j < 64; ++j)
+					table[j] = worker * 100000 + i + j;
+				slots[worker * PER_WORKER + i] = spersist_offset(heap, table);
+			}
+			if (worker == 0) {
+				assert(strcmp(from_parent, "from the parent") == 0);
+				spersist_free(heap, from_parent);
+			}
+			_exit(0);
+		}
+	}
+	for (int worker = 0; worker < WORKERS; ++worker) {
+		int status;
+		wait(&status);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	for (int worker = 0; worker < WORKERS; ++worker) {
+		for (int i = 0; i < PER_WORKER; ++i) {
+			int *table = static_cast<int*>(spersist_pointer(heap, slots[worker * PER_WORKER + i]));
+			for (int j = 0; j < 64; ++j)
+				assert(table[j] == worker * 100000 + i + j);
+			spersist_free(heap, table);
+		}
+	}
+	spersist_free(heap, slots);
+	assert(spersist_allocated_blocks(heap) == 1); // everything merged back into one free block
+	spersist_close(heap);
+}
+
+void test_file_open_in_several_processes() {
+	SPersistentHeap *heap = spersist_open(heap_path, CAPACITY);
+	assert(heap != NULL);
+	const int WORKERS = 3;
+	for (int worker = 0; worker < WORKERS; ++worker) {
+		if (fork() == 0) {
+			// a second open of the file must leave the lock the others use alone
+			SPersistentHeap *opened = spersist_open(heap_path, 0);
+			assert(opened != NULL);
+			for (int i = 0; i < 2000; ++i) {
+				char *scratch = static_cast<char*>(spersist_alloc(opened, 16 + (i * 37) % 3000));
+				assert(scratch != NULL);
+				memset(scratch, worker, 16);
+				spersist_free(opened, scratch);
+			}
+			spersist_close(opened);
+			_exit(0);
+		}
+	}
+	for (int i = 0; i < 2000; ++i) {
+		void *scratch = spersist_alloc(heap, 16 + (i * 53) % 3000);
+		assert(scratch != NULL);
+		spersist_free(heap, scratch);
+	}
+	for (int worker = 0; worker < WORKERS; ++worker) {
+		int status;
+		wait(&status);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	assert(spersist_allocated_blocks(heap) == 1);
+	spersist_close(heap);
+}
+
+void test_shared_by_name() {
+	char name[64];
+	snprintf(name, sizeof(name), "/malloc_persistent_test_%d", getpid());
+	SPersistentHeap *heap = sshared_create(name, CAPACITY);
+	assert(heap != NULL);
+	assert(sshared_create(name, CAPACITY) == NULL);
+	char *greeting = static_cast<char*>(spersist_alloc(heap, 32));
+	strcpy(greeting, "hello");
+	spersist_set_root(heap, greeting);
+	if (fork() == 0) {
+		SPersistentHeap *attached = sshared_attach(name);
+		assert(attached != NULL);
+		char *seen = static_cast<char*>(spersist_root(attached));
+		assert(strcmp(seen, "hello") == 0);
+		char *reply = static_cast<char*>(spersist_alloc(attached, 32));
+		strcpy(reply, "world");
+		spersist_set_root(attached, reply);
+		spersist_free(attached, seen);
+		spersist_close(attached);
+		_exit(0);
+	}
+	int status;
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert(strcmp(static_cast<char*>(spersist_root(heap)), "world") == 0);
+	spersist_close(heap);
+	shm_unlink(name);
+	assert(sshared_attach(name) == NULL);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static int failures = 0;
+
+static void callTestFunction(void (*func)()) {
+	int fd = mkstemp(heap_path);
+	assert(fd >= 0);
+	close(fd);
+	if (!fork()) {  // test as son, to get a clear heap
+		func();
+		exit(0);
+	} else {		// father waits for son before continuing to next test
+		int exit_status = 0;
+		wait(&exit_status);
+		unlink(heap_path);
+		strcpy(heap_path + strlen(heap_path) - 6, "XXXXXX");
+		if (!exit_status)
+			return;
+		++failures;
+		if (WIFEXITED(exit_status) && WEXITSTATUS(exit_status))
+			std::cout << "Exit status ERROR " << WEXITSTATUS(exit_status) << ". ";
+		if (WIFSIGNALED(exit_status))
+			std::cout << "Error signal " << WTERMSIG(exit_status);
+		std::cout << std::endl;
+	}
+}
+
+int main()
+{
+	std::cout << "test_reopen_keeps_allocations" << std::endl;
+	callTestFunction(test_reopen_keeps_allocations);
+	std::cout << "test_free_merges_and_survives_reopen" << std::endl;
+	callTestFunction(test_free_merges_and_survives_reopen);
+	std::cout << "test_capacity_and_bad_files" << std::endl;
+	callTestFunction(test_capacity_and_bad_files);
+	std::cout << "test_shared_between_processes" << std::endl;
+	callTestFunction(test_shared_between_processes);
+	std::cout << "test_file_open_in_several_processes" << std::endl;
+	callTestFunction(test_file_open_in_several_processes);
+	std::cout << "test_shared_by_name" << std::endl;
+	callTestFunction(test_shared_by_name);
+	std::cout << "Done." << std::endl;
+	return failures != 0;
+}
@@ -0,0 +1,417 @@
+/*
+Two-level segregated fit allocator with the smalloc API. Free blocks are kept
+in FL_INDEX_COUNT x SL_INDEX_COUNT lists: the first level is the power of two
+of the size, the second splits that range in SL_INDEX_COUNT equal parts. Two
+bitmaps tell which lists are non-empty, so finding a fitting list, taking a
+block and giving one back all take a constant number of steps. Blocks are
+laid out on the sbrk heap like in malloc_3 (next/prev in address order) and
+blocks of MMAP_MIN_SIZE and above get their own mapping.
+ */
+
+#include <cstring>
+#include <unistd.h>
+#include <cstddef>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "malloc_3.h"
+
+using std::memset;
+using std::memmove;
+
+#define MMAP_MIN_SIZE (128 * 1024)
+#define MAX_SIZE 100000000
+#define MIN_SPLIT 32
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define ALIGN_SIZE_LOG2 3
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_MAX 30
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+struct MallocMetadata{
+    size_t size;
+    bool is_free;
+    bool is_mmap; // a heap block can reach MMAP_MIN_SIZE too, so size does not tell
+    MallocMetadata* next;
+    MallocMetadata* prev;
+    MallocMetadata* next_free;
+    MallocMetadata* prev_free;
+};
+
+static MallocMetadata* list_block_head = nullptr;
+static MallocMetadata* list_block_tail = nullptr;
+static MallocMetadata* mmap_list_block_head = nullptr;
+static MallocMetadata* mmap_list_block_tail = nullptr;
+static unsigned int fl_bitmap = 0;
+static unsigned int sl_bitmap[FL_INDEX_COUNT] = {0};
+static MallocMetadata* free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT] = {{nullptr}};
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t aligned_size(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static char* block_end(MallocMetadata* block) {
+    return (char*)(block + 1) + block->size;
+}
+
+// the next block in the list may sit elsewhere when someone else moved the program break
+static bool adjacent(MallocMetadata* first, MallocMetadata* second) {
+    return first != nullptr and second != nullptr and block_end(first) == (char*)second;
+}
+
+static int fls(size_t word) {
+    return 63 - __builtin_clzll(word);
+}
+
+static void mapping_insert(size_t size, int* fl, int* sl) {
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+        return;
+    }
+    int bit = fls(size);
+    *sl = (size >> (bit - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = bit - FL_INDEX_SHIFT + 1;
+    // coalesced heap blocks can outgrow the table; no request ever searches that far
+    if (*fl >= FL_INDEX_COUNT) {
+        *fl = FL_INDEX_COUNT - 1;
+        *sl = SL_INDEX_COUNT - 1;
+    }
+}
+
+// rounds size up to the next list boundary, so any block in the list found fits
+static void mapping_search(size_t size, int* fl, int* sl) {
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += ((size_t)1 << (fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static MallocMetadata* find_suitable_block(int* fl, int* sl) {
+    if (*fl >= FL_INDEX_COUNT) {
+        return nullptr;
+    }
+    unsigned int sl_map = sl_bitmap[*fl] & (~0U << *sl);
+    if (sl_map == 0) {
+        unsigned int fl_map = *fl + 1 < 32 ? fl_bitmap & (~0U << (*fl + 1)) : 0;
+        if (fl_map == 0) {
+            return nullptr;
+        }
+        *fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[*fl];
+    }
+    *sl = __builtin_ctz(sl_map);
+    return free_lists[*fl][*sl];
+}
+
+static void free_list_insert(MallocMetadata* block) {
+    int fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+    block->is_free = true;
+    block->prev_free = nullptr;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free != nullptr) {
+        block->next_free->prev_free = block;
+    }
+    free_lists[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+static void free_list_remove(MallocMetadata* block) {
+    int fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+    if (block->prev_free != nullptr) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free != nullptr) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (free_lists[fl][sl] == nullptr) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (sl_bitmap[fl] == 0) {
+            fl_bitmap &= ~(1U << fl);
+        }
+    }
+    block->is_free = false;
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+}
+
+// absorbs second, which must follow first in memory, into first
+static void merge(MallocMetadata* first, MallocMetadata* second) {
+    first->size += second->size + _size_meta_data();
+    first->next = second->next;
+    if (second->next != nullptr) {
+        second->next->prev = first;
+    }
+    if (list_block_tail == second) {
+        list_block_tail = first;
+    }
+}
+
+static void split_block(size_t size, MallocMetadata* block_to_split) {
+    if (block_to_split->size < MIN_SPLIT + size + _size_meta_data()) {
+        return;
+    }
+    MallocMetadata* rest = (MallocMetadata*)((char*)(block_to_split + 1) + size);
+    rest->size = block_to_split->size - size - _size_meta_data();
+    rest->is_mmap = false;
+    rest->next = block_to_split->next;
+    rest->prev = block_to_split;
+    if (rest->next != nullptr) {
+        rest->next->prev = rest;
+    }
+    block_to_split->next = rest;
+    block_to_split->size = size;
+    if (list_block_tail == block_to_split) {
+        list_block_tail = rest;
+    }
+    if (rest->next != nullptr and rest->next->is_free and adjacent(rest, rest->next)) {
+        free_list_remove(rest->next);
+        merge(rest, rest->next);
+    }
+    free_list_insert(rest);
+}
+
+static void* mmap_create(size_t size) {
+    void* new_mmap = mmap(NULL, size + _size_meta_data(), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (new_mmap == (void*)(-1)) {
+        return NULL;
+    }
+    MallocMetadata* block = (MallocMetadata*)new_mmap;
+    block->size = size;
+    block->is_free = false;
+    block->is_mmap = true;
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+    block->next = nullptr;
+    block->prev = mmap_list_block_tail;
+    if (mmap_list_block_tail != nullptr) {
+        mmap_list_block_tail->next = block;
+    } else {
+        mmap_list_block_head = block;
+    }
+    mmap_list_block_tail = block;
+    return block + 1;
+}
+
+static void mmap_destroy(MallocMetadata* block) {
+    if (block->prev != nullptr) {
+        block->prev->next = block->next;
+    } else {
+        mmap_list_block_head = block->next;
+    }
+    if (block->next != nullptr) {
+        block->next->prev = block->prev;
+    } else {
+        mmap_list_block_tail = block->prev;
+    }
+    munmap(block, block->size + _size_meta_data());
+}
+
+// grows the heap by one block of size, or grows a free tail block that ends at the program break
+static MallocMetadata* heap_extend(size_t size) {
+    MallocMetadata* tail = list_block_tail;
+    if (tail != nullptr and tail->is_free and sbrk(0) == block_end(tail)) {
+        if (sbrk(size - tail->size) == (void*)(-1)) {
+            return nullptr;
+        }
+        free_list_remove(tail);
+        tail->size = size;
+        return tail;
+    }
+    void* prev_prog_break = sbrk(size + _size_meta_data());
+    if (prev_prog_break == (void*)(-1)) {
+        return nullptr;
+    }
+    MallocMetadata* block = (MallocMetadata*)prev_prog_break;
+    block->size = size;
+    block->is_free = false;
+    block->is_mmap = false;
+    block->next = nullptr;
+    block->prev = tail;
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+    if (tail != nullptr) {
+        tail->next = block;
+    } else {
+        list_block_head = block;
+    }
+    list_block_tail = block;
+    return block;
+}
+
+static void* smalloc_unlocked(size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (size_aligned >= MMAP_MIN_SIZE) {
+        return mmap_create(size_aligned);
+    }
+    int fl, sl;
+    mapping_search(size_aligned, &fl, &sl);
+    MallocMetadata* block = find_suitable_block(&fl, &sl);
+    if (block != nullptr) {
+        free_list_remove(block);
+    } else {
+        block = heap_extend(size_aligned);
+        if (block == nullptr) {
+            return NULL;
+        }
+    }
+    split_block(size_aligned, block);
+    return block + 1;
+}
+
+static void sfree_unlocked(void* p) {
+    if (p == NULL) {
+        return;
+    }
+    MallocMetadata* block = (MallocMetadata*)p - 1;
+    if (block->is_mmap) {
+        mmap_destroy(block);
+        return;
+    }
+    if (block->next != nullptr and block->next->is_free and adjacent(block, block->next)) {
+        free_list_remove(block->next);
+        merge(block, block->next);
+    }
+    if (block->prev != nullptr and block->prev->is_free and adjacent(block->prev, block)) {
+        free_list_remove(block->prev);
+        block = block->prev;
+        merge(block, block->next);
+    }
+    free_list_insert(block);
+}
+
+static void* srealloc_unlocked(void* oldp, size_t size) {
+    size_t size_aligned = aligned_size(size);
+    if (size_aligned == 0 or size_aligned > MAX_SIZE) {
+        return NULL;
+    }
+    if (oldp == NULL) {
+        return smalloc_unlocked(size_aligned);
+    }
+    MallocMetadata* block = (MallocMetadata*)oldp - 1;
+    size_t old_size = block->size;
+    if (not block->is_mmap and size_aligned < MMAP_MIN_SIZE) {
+        if (old_size < size_aligned and block->next != nullptr and block->next->is_free and
+            adjacent(block, block->next) and old_size + _size_meta_data() + block->next->size >= size_aligned) {
+            free_list_remove(block->next);
+            merge(block, block->next);
+        }
+        if (block->size < size_aligned and block == list_block_tail and sbrk(0) == block_end(block)) {
+            if (sbrk(size_aligned - block->size) == (void*)(-1)) {
+                return NULL;
+            }
+            block->size = size_aligned;
+        }
+        if (block->size >= size_aligned) {
+            split_block(size_aligned, block);
+            return oldp;
+        }
+    } else if (block->is_mmap and old_size == size_aligned) {
+        return oldp;
+    }
+    void* new_block = smalloc_unlocked(size_aligned);
+    if (new_block != NULL) {
+        memmove(new_block, oldp, size_aligned < old_size ? size_aligned : old_size);
+        sfree_unlocked(oldp);
+    }
+    return new_block;
+}
+
+void* smalloc(size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    void* address = smalloc_unlocked(size);
+    pthread_mutex_unlock(&heap_lock);
+    return address;
+}
+
+void* scalloc(size_t num, size_t size) {
+    if (size == 0 or num == 0 or num > MAX_SIZE / size) {
+        return NULL;
+    }
+    void* address = smalloc(num * size);
+    if (address != NULL) {
+        memset(address, 0, num * size);
+    }
+    return address;
+}
+
+void sfree(void* p) {
+    pthread_mutex_lock(&heap_lock);
+    sfree_unlocked(p);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    void* address = srealloc_unlocked(oldp, size);
+    pthread_mutex_unlock(&heap_lock);
+    return address;
+}
+
+size_t _num_free_blocks() {
+    pthread_mutex_lock(&heap_lock);
+    size_t count_of_free_blocks = 0;
+    for (MallocMetadata* tmp = list_block_head; tmp != nullptr; tmp = tmp->next) {
+        if (tmp->is_free) {
+            ++count_of_free_blocks;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return count_of_free_blocks;
+}
+
+size_t _num_free_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    size_t num_of_free_bytes = 0;
+    for (MallocMetadata* tmp = list_block_head; tmp != nullptr; tmp = tmp->next) {
+        if (tmp->is_free) {
+            num_of_free_bytes += tmp->size;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return num_of_free_bytes;
+}
+
+size_t _num_allocated_blocks() {
+    pthread_mutex_lock(&heap_lock);
+    size_t count_of_allocated_blocks = 0;
+    for (MallocMetadata* tmp = list_block_head; tmp != nullptr; tmp = tmp->next) {
+        ++count_of_allocated_blocks;
+    }
+    for (MallocMetadata* tmp = mmap_list_block_head; tmp != nullptr; tmp = tmp->next) {
+        ++count_of_allocated_blocks;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return count_of_allocated_blocks;
+}
+
+size_t _num_allocated_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    size_t num_of_allocated_bytes = 0;
+    for (MallocMetadata* tmp = list_block_head; tmp != nullptr; tmp = tmp->next) {
+        num_of_allocated_bytes += tmp->size;
+    }
+    for (MallocMetadata* tmp = mmap_list_block_head; tmp != nullptr; tmp = tmp->next) {
+        num_of_allocated_bytes += tmp->size;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return num_of_allocated_bytes;
+}
+
+size_t _num_meta_data_bytes() {
+    return _num_allocated_blocks() * _size_meta_data();
+}
+
+size_t _size_meta_data() {
+    return sizeof(MallocMetadata);
+}
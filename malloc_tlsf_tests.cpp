@@ -0,0 +1,216 @@
+/*
+Tests for the TLSF backend (malloc_tlsf.cpp).
+Every test runs in a forked child so it starts from a clean heap.
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <iostream>
+#include "malloc_3.h"
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_alloc_and_free_stats() {
+	assert(smalloc(0) == NULL);
+	assert(smalloc(100000001) == NULL);
+	char *a = static_cast<char*>(smalloc(10));
+	char *b = static_cast<char*>(smalloc(100));
+	assert(a != NULL and b != NULL);
+	assert(reinterpret_cast<size_t>(a) % 8 == 0 and reinterpret_cast<size_t>(b) % 8 == 0);
+	assert(_num_allocated_blocks() == 2);
+	assert(_num_allocated_bytes() == 16 + 104);
+	assert(_num_free_blocks() == 0);
+	sfree(a);
+	assert(_num_free_blocks() == 1);
+	assert(_num_free_bytes() == 16);
+	sfree(b);
+	assert(_num_free_blocks() == 1);
+	assert(_num_allocated_blocks() == 1);
+	assert(_num_free_bytes() == 16 + 104 + _size_meta_data());
+	assert(_num_meta_data_bytes() == _size_meta_data());
+}
+
+void test_coalesce_and_split() {
+	char *blocks[3];
+	for (int i = 0; i < 3; ++i)
+		blocks[i] = static_cast<char*>(smalloc(1000));
+	void *guard = smalloc(8);
+	sfree(blocks[0]);
+	sfree(blocks[2]);
+	assert(_num_free_blocks() == 2);
+	sfree(blocks[1]);
+	assert(_num_free_blocks() == 1);
+	assert(_num_free_bytes() == 3000 + 2 * _size_meta_data());
+	char *small = static_cast<char*>(smalloc(200));
+	assert(small == blocks[0]);
+	assert(_num_allocated_blocks() == 3);
+	assert(_num_free_bytes() == 3000 + _size_meta_data() - 200);
+	sfree(small);
+	sfree(guard);
+}
+
+void test_good_fit() {
+	void *big = smalloc(4000);
+	void *guard1 = smalloc(8);
+	void *fit = smalloc(520);
+	void *guard2 = smalloc(8);
+	sfree(big);
+	sfree(fit);
+	// 500 rounds up into the 512..543 list, so the 520 hole is taken over the 4000 one
+	assert(smalloc(500) == fit);
+	sfree(guard1);
+	sfree(guard2);
+}
+
+void test_realloc() {
+	char *a = static_cast<char*>(smalloc(100));
+	memset(a, 'x', 100);
+	char *b = static_cast<char*>(smalloc(1000));
+	void *guard = smalloc(8);
+	sfree(b);
+	char *grown = static_cast<char*>(srealloc(a, 800));
+	assert(grown == a);
+	assert(grown[99] == 'x');
+	char *shrunk = static_cast<char*>(srealloc(grown, 16));
+	assert(shrunk == a);
+	sfree(guard);
+	// larger than any hole, so it lands at the program break and grows in place
+	char *tail = static_cast<char*>(smalloc(5000));
+	memset(tail, 'y', 5000);
+	char *tail_grown = static_cast<char*>(srealloc(tail, 10000));
+	assert(tail_grown == tail);
+	assert(tail_grown[4999] == 'y');
+	char *moved = static_cast<char*>(srealloc(shrunk, 200000));
+	assert(moved != NULL and moved != shrunk);
+	assert(moved[0] == 'x');
+	sfree(moved);
+	sfree(tail_grown);
+}
+
+void test_mmap_blocks() {
+	size_t blocks = _num_allocated_blocks();
+	char *big = static_cast<char*>(smalloc(200000));
+	assert(big != NULL);
+	memset(big, 1, 200000);
+	assert(_num_allocated_blocks() == blocks + 1);
+	assert(_num_allocated_bytes() >= 200000);
+	char *zeroed = static_cast<char*>(scalloc(1000, 200));
+	assert(zeroed != NULL and zeroed[199999] == 0);
+	sfree(big);
+	sfree(zeroed);
+	assert(_num_allocated_blocks() == blocks);
+}
+
+void test_large_heap_block() {
+	// two merged heap blocks make one of MMAP_MIN_SIZE, which is still no mmap
+	char *first = static_cast<char*>(smalloc(65536));
+	void *second = smalloc(65536 - _size_meta_data());
+	void *guard = smalloc(8);
+	sfree(first);
+	sfree(second);
+	char *large = static_cast<char*>(smalloc(131064));
+	assert(large == first);
+	memset(large, 2, 131064);
+	large = static_cast<char*>(srealloc(large, 1000));
+	assert(large == first && large[999] == 2);
+	large = static_cast<char*>(srealloc(large, 131064));
+	assert(large == first);
+	sfree(large);
+	sfree(guard);
+	assert(_num_free_blocks() == _num_allocated_blocks());
+}
+
+void test_wrapping_sizes() {
+	// rounding these up to a multiple of 8 wraps around to 0
+	size_t blocks = _num_allocated_blocks();
+	assert(smalloc((size_t)-1) == NULL);
+	assert(smalloc((size_t)-7) == NULL);
+	assert(srealloc(NULL, (size_t)-1) == NULL);
+	char *p = static_cast<char*>(smalloc(100));
+	memset(p, 'z', 100);
+	assert(srealloc(p, (size_t)-3) == NULL);
+	assert(p[99] == 'z');
+	assert(_num_allocated_blocks() == blocks + 1);
+	sfree(p);
+}
+
+void test_random_workload() {
+	const int SLOTS = 512;
+	char *slots[SLOTS] = {NULL};
+	size_t sizes[SLOTS] = {0};
+	srand(7);
+	for (int i = 0; i < 100000; ++i) {
+		int slot = rand() % SLOTS;
+		if (slots[slot] != NULL) {
+			for (size_t j = 0; j < sizes[slot]; j += 97)
+				assert(slots[slot][j] == static_cast<char>(slot));
+		}
+		size_t size = 1 + rand() % (rand() % 16 ? 2000 : 150000);
+		if (slots[slot] == NULL) {
+			slots[slot] = static_cast<char*>(smalloc(size));
+		} else if (rand() % 2) {
+			slots[slot] = static_cast<char*>(srealloc(slots[slot], size));
+		} else {
+			sfree(slots[slot]);
+			slots[slot] = NULL;
+			continue;
+		}
+		assert(slots[slot] != NULL);
+		sizes[slot] = size;
+		memset(slots[slot], slot, size);
+	}
+	for (int i = 0; i < SLOTS; ++i)
+		sfree(slots[i]);
+	assert(_num_free_blocks() <= 1);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static int failures = 0;
+
+static void callTestFunction(void (*func)()) {
+	if (!fork()) {  // test as son, to get a clear heap
+		func();
+		exit(0);
+	} else {		// father waits for son before continuing to next test
+		int exit_status = 0;
+		wait(&exit_status);
+		if (!exit_status)
+			return;
+		++failures;
+		if (WIFEXITED(exit_status) && WEXITSTATUS(exit_status))
+			std::cout << "Exit status ERROR " << WEXITSTATUS(exit_status) << ". ";
+		if (WIFSIGNALED(exit_status))
+			std::cout << "Error signal " << WTERMSIG(exit_status);
+		std::cout << std::endl;
+	}
+}
+
+int main()
+{
+	std::cout << "test_alloc_and_free_stats" << std::endl;
+	callTestFunction(test_alloc_and_free_stats);
+	std::cout << "test_coalesce_and_split" << std::endl;
+	callTestFunction(test_coalesce_and_split);
+	std::cout << "test_good_fit" << std::endl;
+	callTestFunction(test_good_fit);
+	std::cout << "test_realloc" << std::endl;
+	callTestFunction(test_realloc);
+	std::cout << "test_mmap_blocks" << std::endl;
+	callTestFunction(test_mmap_blocks);
+	std::cout << "test_large_heap_block" << std::endl;
+	callTestFunction(test_large_heap_block);
+	std::cout << "test_wrapping_sizes" << std::endl;
+	callTestFunction(test_wrapping_sizes);
+	std::cout << "test_random_workload" << std::endl;
+	callTestFunction(test_random_workload);
+	std::cout << "Done." << std::endl;
+	return failures != 0;
+}
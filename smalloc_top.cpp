@@ -0,0 +1,128 @@
+/*
+Live view of a malloc_4 process that called stelemetry_start:
+
+    smalloc-top <pid> [interval_ms] [count]
+
+Maps the telemetry page /smalloc.<pid> read-only and prints every interval_ms
+(default 1000) the heap totals, the call and system call counters with their
+rate over the last interval, and the occupancy of the free bins. It stops
+after count screens (default: when the process exits).
+ */
+
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include "malloc_4_telemetry.h"
+
+// the writer stores every word with a relaxed store, read them the same way
+static void snapshot(const STelemetry *page, STelemetry *copy) {
+	const uint64_t *from = reinterpret_cast<const uint64_t *>(page);
+	uint64_t *to = reinterpret_cast<uint64_t *>(copy);
+	for (size_t i = 0; i < sizeof(STelemetry) / sizeof(uint64_t); ++i)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static const STelemetry *open_page(long pid) {
+	char name[32];
+	stelemetry_name(name, sizeof(name), pid);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return nullptr;
+	void *page = mmap(NULL, sizeof(STelemetry), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return nullptr;
+	const STelemetry *telemetry = static_cast<const STelemetry *>(page);
+	if (__atomic_load_n(&telemetry->magic, __ATOMIC_ACQUIRE) != STELEMETRY_MAGIC ||
+		telemetry->version != STELEMETRY_VERSION) {
+		munmap(page, sizeof(STelemetry));
+		return nullptr;
+	}
+	return telemetry;
+}
+
+static void print_bytes_row(const char *name, uint64_t blocks, uint64_t bytes) {
+	std::cout << std::left << std::setw(18) << name << std::right
+			  << std::setw(14) << blocks << std::setw(18) << bytes << std::endl;
+}
+
+static void print_rate_row(const char *name, uint64_t now, uint64_t before, double seconds) {
+	std::cout << std::left << std::setw(18) << name << std::right << std::setw(14) << now
+			  << std::fixed << std::setprecision(0) << std::setw(18) << (now - before) / seconds << std::endl;
+}
+
+static void print_screen(long pid, const STelemetry &now, const STelemetry &before, double seconds) {
+	if (isatty(STDOUT_FILENO))
+		std::cout << "\033[H\033[2J";
+	std::cout << "smalloc-top  pid " << pid << "  every " << std::fixed << std::setprecision(1) << seconds << "s"
+			  << std::endl << std::endl;
+	std::cout << std::left << std::setw(18) << "" << std::right << std::setw(14) << "blocks"
+			  << std::setw(18) << "bytes" << std::endl;
+	print_bytes_row("allocated", stelemetry_allocated_blocks(&now), stelemetry_allocated_bytes(&now));
+	print_bytes_row("free", stelemetry_free_blocks(&now), stelemetry_free_bytes(&now));
+	print_bytes_row("meta data", stelemetry_allocated_blocks(&now), stelemetry_meta_data_bytes(&now));
+	print_bytes_row("sbrk heap", now.heap_blocks, now.heap_bytes);
+	print_bytes_row("page heap", now.page_runs, now.page_bytes);
+	print_bytes_row("mmap", now.mmap_blocks, now.mmap_bytes);
+	std::cout << std::endl << std::left << std::setw(18) << "" << std::right << std::setw(14) << "total"
+			  << std::setw(18) << "per second" << std::endl;
+	print_rate_row("smalloc", now.smalloc_calls, before.smalloc_calls, seconds);
+	print_rate_row("sfree", now.sfree_calls, before.sfree_calls, seconds);
+	print_rate_row("  remote", now.remote_frees, before.remote_frees, seconds);
+	print_rate_row("srealloc", now.srealloc_calls, before.srealloc_calls, seconds);
+	print_rate_row("sbrk", now.sbrk_calls, before.sbrk_calls, seconds);
+	print_rate_row("mmap", now.mmap_calls, before.mmap_calls, seconds);
+	print_rate_row("munmap", now.munmap_calls, before.munmap_calls, seconds);
+	print_rate_row("mprotect", now.mprotect_calls, before.mprotect_calls, seconds);
+	print_rate_row("madvise", now.madvise_calls, before.madvise_calls, seconds);
+	std::cout << std::endl << std::left << std::setw(18) << "free bin" << std::right << std::setw(14) << "blocks"
+			  << std::setw(18) << "bytes" << std::endl;
+	print_bytes_row("fast", now.fast_bin_blocks, now.fast_bin_bytes);
+	for (size_t index = 0; index < STELEMETRY_BINS; ++index) {
+		if (now.bin_blocks[index] == 0)
+			continue;
+		std::string name = std::to_string(index) + "KB";
+		print_bytes_row(name.c_str(), now.bin_blocks[index], now.bin_bytes[index]);
+	}
+	print_bytes_row("page runs", now.page_free_runs, now.page_free_bytes);
+	std::cout << std::flush;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		std::cerr << "usage: smalloc-top <pid> [interval_ms] [count]" << std::endl;
+		return 2;
+	}
+	long pid = atol(argv[1]);
+	long interval_ms = argc > 2 ? atol(argv[2]) : 1000;
+	long count = argc > 3 ? atol(argv[3]) : -1;
+	if (interval_ms <= 0)
+		interval_ms = 1000;
+	const STelemetry *page = open_page(pid);
+	if (page == nullptr) {
+		std::cerr << "smalloc-top: no telemetry page for pid " << pid << std::endl;
+		return 1;
+	}
+	STelemetry before, now;
+	snapshot(page, &before);
+	for (long screen = 0; count < 0 || screen < count; ++screen) {
+		usleep(interval_ms * 1000);
+		if (kill(pid, 0) != 0 && errno == ESRCH) {
+			std::cerr << "smalloc-top: pid " << pid << " is gone" << std::endl;
+			break;
+		}
+		snapshot(page, &now);
+		print_screen(pid, now, before, interval_ms / 1000.0);
+		before = now;
+	}
+	munmap(const_cast<STelemetry *>(page), sizeof(STelemetry));
+	return 0;
+}